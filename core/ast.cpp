@@ -1,13 +1,340 @@
 #include "ast.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+#include "host_registry.hpp"
+
 namespace ast {
+Type::Type(Kind kind, unsigned lanes) : kind(kind), lanes(lanes) {}
+
+namespace {
+std::optional<Type::Kind> scalarKind(const std::string &name) {
+  if (name == "bool") {
+    return Type::Bool;
+  }
+  if (name == "i64") {
+    return Type::I64;
+  }
+  if (name == "f32") {
+    return Type::F32;
+  }
+  if (name == "f64") {
+    return Type::F64;
+  }
+  return std::nullopt;
+}
+
+std::optional<Type> typeNamed(const std::string &name) {
+  if (name == "f64[]") {
+    return Type::F64Buffer;
+  }
+  size_t x = name.find('x');
+  auto kind = scalarKind(name.substr(0, x));
+  if (kind && x == std::string::npos) {
+    return *kind;
+  }
+  if (kind) {
+    for (unsigned lanes : {2u, 4u, 8u, 16u}) {
+      if (name.compare(x + 1, std::string::npos, std::to_string(lanes)) ==
+          0) {
+        return Type(*kind, lanes);
+      }
+    }
+  }
+  return std::nullopt;
+}
+} // namespace
+
+Type Type::fromName(const std::string &name) {
+  if (auto type = typeNamed(name)) {
+    return *type;
+  }
+  throw std::runtime_error("unknown type " + name);
+}
+
+Type Type::fromLLVM(llvm::Type *type) {
+  if (type->isVectorTy()) {
+    Type element = fromLLVM(type->getScalarType());
+    unsigned lanes = type->getVectorNumElements();
+    if (!element.isBuffer() && isLaneCount(lanes)) {
+      return Type(element.kind, lanes);
+    }
+  }
+  if (type->isIntegerTy(1)) {
+    return Bool;
+  }
+  if (type->isIntegerTy(64)) {
+    return I64;
+  }
+  if (type->isFloatTy()) {
+    return F32;
+  }
+  if (type->isDoubleTy()) {
+    return F64;
+  }
+  if (type->isPointerTy() &&
+      type->getPointerElementType()->isDoubleTy()) {
+    return F64Buffer;
+  }
+  throw std::runtime_error("value has no kaleidoscope type");
+}
+
+bool Type::isLaneCount(unsigned lanes) noexcept {
+  return lanes == 2 || lanes == 4 || lanes == 8 || lanes == 16;
+}
+
+llvm::Type *Type::llvmType(llvm::LLVMContext &context) const {
+  if (isVector()) {
+    return llvm::VectorType::get(element().llvmType(context), lanes);
+  }
+  switch (kind) {
+  case Bool:
+    return llvm::Type::getInt1Ty(context);
+  case I64:
+    return llvm::Type::getInt64Ty(context);
+  case F32:
+    return llvm::Type::getFloatTy(context);
+  case F64:
+    return llvm::Type::getDoubleTy(context);
+  case F64Buffer:
+    return llvm::Type::getDoublePtrTy(context);
+  }
+  throw std::runtime_error("unknown type");
+}
+
+bool Type::isFloat() const noexcept { return kind == F32 || kind == F64; }
+
+bool Type::isBuffer() const noexcept { return kind == F64Buffer; }
+
+bool Type::isVector() const noexcept { return lanes > 1; }
+
+Type Type::element() const noexcept { return kind; }
+
+bool Type::operator==(const Type &other) const noexcept {
+  return kind == other.kind && lanes == other.lanes;
+}
+
+bool Type::operator!=(const Type &other) const noexcept {
+  return !(*this == other);
+}
+
+std::ostream &operator<<(std::ostream &out, const Type &type) {
+  const char *names[] = {"bool", "i64", "f32", "f64", "f64[]"};
+  out << names[type.kind];
+  if (type.isVector()) {
+    out << 'x' << type.lanes;
+  }
+  return out;
+}
+
+void GenState::resetContext() {
+  optPasses.reset();
+  llvmModule.reset();
+  namedValues.clear();
+  builder.reset();
+  context = std::make_unique<llvm::LLVMContext>();
+  builder = std::make_unique<llvm::IRBuilder<>>(*context);
+}
+
+std::optional<FPMode> fpModeFromName(const std::string &name) {
+  if (name == "strict") {
+    return FPMode::Strict;
+  }
+  if (name == "contract") {
+    return FPMode::Contract;
+  }
+  if (name == "fast") {
+    return FPMode::Fast;
+  }
+  return std::nullopt;
+}
+
+namespace {
+void applyFPMode(GenState &state, llvm::Function &function, FPMode mode) {
+  llvm::FastMathFlags fmf;
+  if (mode == FPMode::Contract) {
+    fmf.setAllowContract(true);
+  } else if (mode == FPMode::Fast) {
+    fmf.setFast();
+    // The per-function equivalents of the fast-math TargetOptions.
+    for (const char *attr : {"unsafe-fp-math", "no-infs-fp-math",
+                             "no-nans-fp-math", "no-signed-zeros-fp-math"}) {
+      function.addFnAttr(attr, "true");
+    }
+  }
+  state.builder->setFastMathFlags(fmf);
+}
+
+// The hidden parameter holding the length of buffer parameter name.
+std::string lengthName(const std::string &name) { return name + ".len"; }
+
+void appendBytes(std::string &key, const void *data, size_t size) {
+  key.append(static_cast<const char *>(data), size);
+}
+
+// Length-prefixed, so adjacent names can't run into each other.
+void appendName(std::string &key, const std::string &name) {
+  uint32_t size = static_cast<uint32_t>(name.size());
+  appendBytes(key, &size, sizeof(size));
+  key += name;
+}
+
+void appendType(std::string &key, Type type) {
+  key += static_cast<char>(type.kind);
+  key += static_cast<char>(type.lanes);
+}
+} // namespace
+
+llvm::Value *convert(GenState &state, llvm::Value *value, Type type) {
+  Type from = Type::fromLLVM(value->getType());
+  if (from == type) {
+    return value;
+  }
+  if (from.isBuffer() || type.isBuffer()) {
+    throw std::runtime_error("buffers can only be indexed or passed on");
+  }
+
+  auto &b = *state.builder;
+  if (type.isVector() && !from.isVector()) {
+    return b.CreateVectorSplat(
+        type.lanes, convert(state, value, type.element()), "splat");
+  }
+  if (from.lanes != type.lanes) {
+    throw std::runtime_error(
+        type.isVector()
+            ? "vectors of different widths can't be converted"
+            : "vectors only become scalars through extract or a reduction");
+  }
+
+  // Lane-wise for vectors, which the constants below are splatted across.
+  llvm::Type *to = type.llvmType(*state.context);
+  switch (from.kind) {
+  case Type::Bool:
+    return type.isFloat() ? b.CreateUIToFP(value, to, "booltmp")
+                          : b.CreateZExt(value, to, "booltmp");
+  case Type::I64:
+    if (type.kind == Type::Bool) {
+      return b.CreateICmpNE(value, llvm::ConstantInt::get(value->getType(), 0),
+                            "tobool");
+    }
+    return b.CreateSIToFP(value, to, "convtmp");
+  case Type::F32:
+  case Type::F64:
+    if (type.kind == Type::Bool) {
+      return b.CreateFCmpUNE(
+          value, llvm::ConstantFP::get(value->getType(), 0.0), "tobool");
+    }
+    if (type.kind == Type::I64) {
+      return b.CreateFPToSI(value, to, "convtmp");
+    }
+    return b.CreateFPCast(value, to, "convtmp");
+  case Type::F64Buffer:
+    break;
+  }
+  std::ostringstream message;
+  message << "cannot convert " << from << " to " << type;
+  throw std::runtime_error(message.str());
+}
+
+bool isBuiltin(const std::string &name) {
+  for (const char *builtin :
+       {"len", "extract", "insert", "shuffle", "hsum", "hmin", "hmax"}) {
+    if (name == builtin) {
+      return true;
+    }
+  }
+  auto type = typeNamed(name);
+  return type && type->isVector();
+}
+
+namespace {
+llvm::Function *declareHostFunction(const host::Function &host,
+                                    GenState &state) {
+  std::vector<std::string> argNames;
+  for (size_t i = 0; i < host.argTypes.size(); ++i) {
+    argNames.push_back("arg" + std::to_string(i));
+  }
+  Prototype proto(host.name, argNames, true, host.argTypes, host.retType);
+  llvm::FunctionType *fT = proto.functionType(*state.context);
+
+  llvm::Function *f;
+  if (host.ir.empty()) {
+    f = llvm::Function::Create(fT, llvm::Function::ExternalLinkage, host.name,
+                               state.llvmModule.get());
+  } else {
+    llvm::SMDiagnostic err;
+    if (llvm::parseAssemblyInto(llvm::MemoryBufferRef(host.ir, host.name),
+                                state.llvmModule.get(), nullptr, err)) {
+      throw std::runtime_error("IR body of " + host.name + ": " +
+                               err.getMessage().str());
+    }
+    f = state.llvmModule->getFunction(host.name);
+    if (!f || f->isDeclaration()) {
+      throw std::runtime_error("IR body does not define " + host.name);
+    }
+    // Visible to the inliner, but never emitted: the host's copy is the one
+    // that gets called.
+    f->setLinkage(llvm::Function::AvailableExternallyLinkage);
+  }
+  if (f->getFunctionType() != fT) {
+    throw std::runtime_error("IR body of " + host.name +
+                             " does not match its signature");
+  }
+
+  if (host.pure) {
+    f->setDoesNotAccessMemory();
+  }
+  if (host.nothrow) {
+    f->setDoesNotThrow();
+  }
+  return f;
+}
+
+// Host functions with an IR body are inlined before the function passes run
+// so they see through them.
+void inlineHostBodies(llvm::Function &function) {
+  std::vector<llvm::CallInst *> calls;
+  for (auto &block : function) {
+    for (auto &inst : block) {
+      auto *call = llvm::dyn_cast<llvm::CallInst>(&inst);
+      auto *callee = call ? call->getCalledFunction() : nullptr;
+      if (callee && callee->hasAvailableExternallyLinkage()) {
+        calls.push_back(call);
+      }
+    }
+  }
+  for (auto *call : calls) {
+    llvm::InlineFunctionInfo info;
+    llvm::InlineFunction(call, info);
+  }
+}
+} // namespace
 
 llvm::Function *getFunction(const std::string &name, GenState &state) {
-  if (auto *f = state.llvmModule->getFunction(name)) {
+  auto fI = state.functionProtos.find(name);
+  std::string symbol =
+      fI != state.functionProtos.end() ? fI->second->symbolName(state) : name;
+  if (auto *f = state.llvmModule->getFunction(symbol)) {
     return f;
   }
 
-  auto fI = state.functionProtos.find(name);
+  // Registered host functions take the place of a plain extern.
+  const host::Function *hostFunction =
+      state.hostFunctions ? state.hostFunctions->find(name) : nullptr;
+  if (hostFunction &&
+      (fI == state.functionProtos.end() || fI->second->isExtern)) {
+    return declareHostFunction(*hostFunction, state);
+  }
+
   if (fI != state.functionProtos.end()) {
     return fI->second->codegen(state);
   }
@@ -16,10 +343,139 @@ llvm::Function *getFunction(const std::string &name, GenState &state) {
 }
 
 namespace expr {
+namespace {
+// Points the instructions generated next at location, if it is known and
+// the function being generated has debug info.
+void setLocation(GenState &state, tokens::Location location) {
+  llvm::Function *function = state.builder->GetInsertBlock()->getParent();
+  llvm::DISubprogram *scope = function->getSubprogram();
+  if (scope && location.line) {
+    state.builder->SetCurrentDebugLocation(llvm::DILocation::get(
+        *state.context, location.line, location.column, scope));
+  }
+}
+
+// Counts one more level of maxCodegenNesting for as long as it lives.
+class NestingGuard {
+public:
+  explicit NestingGuard(GenState &state) : nesting(state.nesting) {
+    if (nesting == maxCodegenNesting) {
+      throw std::runtime_error(
+          "calls, conditionals, loops and indexing are nested more than " +
+          std::to_string(maxCodegenNesting) + " deep");
+    }
+    ++nesting;
+  }
+  ~NestingGuard() { --nesting; }
+
+private:
+  unsigned &nesting;
+};
+
+// Calls f on each child of node, in source order.
+template <typename F> void forEachChild(const ExprNode &node, F &&f) {
+  if (auto *bin = std::get_if<Binary>(&node)) {
+    f(*bin->lhs);
+    f(*bin->rhs);
+  } else if (auto *call = std::get_if<Call>(&node)) {
+    for (const auto &arg : call->args) {
+      f(*arg);
+    }
+  } else if (auto *ifExpr = std::get_if<If>(&node)) {
+    f(*ifExpr->cond);
+    f(*ifExpr->then);
+    f(*ifExpr->otherwise);
+  } else if (auto *forExpr = std::get_if<For>(&node)) {
+    f(*forExpr->start);
+    f(*forExpr->cond);
+    if (forExpr->step) {
+      f(*forExpr->step);
+    }
+    f(*forExpr->body);
+  } else if (auto *index = std::get_if<Index>(&node)) {
+    f(*index->index);
+    if (index->value) {
+      f(*index->value);
+    }
+  }
+}
+
+// Visits every node under root, parents before children, with an explicit
+// stack rather than recursion.
+template <typename F> void walk(const ExprNode &root, F &&visit) {
+  std::vector<const ExprNode *> stack{&root};
+  while (!stack.empty()) {
+    const ExprNode &node = *stack.back();
+    stack.pop_back();
+    visit(node);
+    size_t first = stack.size();
+    forEachChild(node, [&](const ExprNode &child) { stack.push_back(&child); });
+    std::reverse(stack.begin() + first, stack.end());
+  }
+}
+
+// Frees the trees in pending. Each node hands its children over to pending
+// before it is deleted, so its own destructor has nothing left to free.
+void release(std::vector<std::unique_ptr<ExprNode>> pending) {
+  while (!pending.empty()) {
+    auto node = std::move(pending.back());
+    pending.pop_back();
+    if (auto *bin = std::get_if<Binary>(node.get())) {
+      pending.push_back(std::move(bin->lhs));
+      pending.push_back(std::move(bin->rhs));
+    } else if (auto *call = std::get_if<Call>(node.get())) {
+      for (auto &arg : call->args) {
+        pending.push_back(std::move(arg));
+      }
+    } else if (auto *ifExpr = std::get_if<If>(node.get())) {
+      pending.push_back(std::move(ifExpr->cond));
+      pending.push_back(std::move(ifExpr->then));
+      pending.push_back(std::move(ifExpr->otherwise));
+    } else if (auto *forExpr = std::get_if<For>(node.get())) {
+      pending.push_back(std::move(forExpr->start));
+      pending.push_back(std::move(forExpr->cond));
+      pending.push_back(std::move(forExpr->step));
+      pending.push_back(std::move(forExpr->body));
+    } else if (auto *index = std::get_if<Index>(node.get())) {
+      pending.push_back(std::move(index->index));
+      pending.push_back(std::move(index->value));
+    }
+  }
+}
+
+template <typename... Children> void release(Children &...children) {
+  std::vector<std::unique_ptr<ExprNode>> pending;
+  (pending.push_back(std::move(children)), ...);
+  release(std::move(pending));
+}
+} // namespace
+
 Number::Number(double val) : val(val) {}
 
 llvm::Value *Number::codegen(GenState &state) {
-  return llvm::ConstantFP::get(state.context, llvm::APFloat(val));
+  return llvm::ConstantFP::get(*state.context, llvm::APFloat(val));
+}
+
+llvm::Value *Number::codegenAs(GenState &state, Type type) {
+  if (type.isVector()) {
+    return state.builder->CreateVectorSplat(
+        type.lanes, codegenAs(state, type.element()), "splat");
+  }
+  switch (type.kind) {
+  case Type::I64:
+    // Fractions are truncated, like converted values are.
+    if (!(val >= -0x1p63 && val < 0x1p63)) {
+      std::ostringstream message;
+      message << "literal " << val << " does not fit in an i64";
+      throw std::runtime_error(message.str());
+    }
+    return llvm::ConstantInt::get(llvm::Type::getInt64Ty(*state.context),
+                                  static_cast<int64_t>(val), true);
+  case Type::F32:
+    return llvm::ConstantFP::get(llvm::Type::getFloatTy(*state.context), val);
+  default:
+    return codegen(state);
+  }
 }
 
 std::ostream &operator<<(std::ostream &out, const Number &expr) {
@@ -46,28 +502,181 @@ Binary::Binary(char op, std::unique_ptr<ExprNode> lhs,
                std::unique_ptr<ExprNode> rhs)
     : op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
 
+Binary::~Binary() { release(lhs, rhs); }
+
+namespace {
+// Literals adopt the type of the other operand when they can be represented
+// in it, so `i + 1` stays integer math and `x * 0.5` stays f32 for an f32 x:
+// integral literals in range for i64, and any literal for f32, rounded to
+// the nearest float.
+bool adoptsType(const Number &literal, Type type) {
+  return type.kind == Type::F32 ||
+         (type.kind == Type::I64 && literal.val == std::trunc(literal.val) &&
+          std::abs(literal.val) < 0x1p63);
+}
+
+// bool < i64 < f32 < f64: operands are widened to the larger of the two.
+// Booleans are only ever operated on as numbers. A scalar operand of a vector
+// one is broadcast to all its lanes.
+Type commonType(Type lhs, Type rhs) {
+  if (lhs.isBuffer() || rhs.isBuffer()) {
+    throw std::runtime_error("buffers can only be indexed or passed on");
+  }
+  if (lhs.isVector() && rhs.isVector() && lhs.lanes != rhs.lanes) {
+    throw std::runtime_error("operands are vectors of different widths");
+  }
+  Type::Kind common = std::max(lhs.kind, rhs.kind);
+  return Type(common == Type::Bool ? Type::I64 : common,
+              std::max(lhs.lanes, rhs.lanes));
+}
+} // namespace
+
+// Lowers a whole tree of binary operators with an explicit stack: generated
+// formulas can nest far deeper than the native stack allows. Anything else
+// in the tree is generated as usual.
 llvm::Value *Binary::codegen(GenState &state) {
-  auto codegenVisitor = [&](auto &val) { return val.codegen(state); };
-  llvm::Value *L = std::visit(codegenVisitor, *lhs);
-  llvm::Value *R = std::visit(codegenVisitor, *rhs);
+  struct Frame {
+    explicit Frame(Binary *node) : node(node) {}
+
+    Binary *node;
+    // Operands generated so far, in the order they were generated.
+    llvm::Value *values[2] = {nullptr, nullptr};
+    int generated = 0;
+  };
+  std::vector<Frame> frames;
+  frames.emplace_back(this);
+  llvm::Value *result = nullptr;
+  while (true) {
+    auto &frame = frames.back();
+    auto &node = *frame.node;
+    if (result) {
+      frame.values[frame.generated++] = result;
+      result = nullptr;
+    }
+
+    // A literal takes on the type of the other operand, so when only the
+    // lhs is one, the rhs is generated first.
+    bool rhsFirst = std::holds_alternative<Number>(*node.lhs) &&
+                    !std::holds_alternative<Number>(*node.rhs);
+    if (frame.generated == 2) {
+      llvm::Value *L = frame.values[rhsFirst ? 1 : 0];
+      llvm::Value *R = frame.values[rhsFirst ? 0 : 1];
+      setLocation(state, node.location);
+      result = node.emit(state, L, R);
+      frames.pop_back();
+      if (frames.empty()) {
+        return result;
+      }
+      continue;
+    }
+
+    ExprNode &operand =
+        (frame.generated == 0) == rhsFirst ? *node.rhs : *node.lhs;
+    auto *literal = std::get_if<Number>(&operand);
+    if (frame.generated == 1 && literal) {
+      Type first = Type::fromLLVM(frame.values[0]->getType());
+      frame.values[frame.generated++] = adoptsType(*literal, first)
+                                            ? literal->codegenAs(state, first)
+                                            : literal->codegen(state);
+    } else if (auto *bin = std::get_if<Binary>(&operand)) {
+      frames.emplace_back(bin);
+    } else {
+      frame.values[frame.generated++] = std::visit(
+          [&](auto &val) { return val.codegen(state); }, operand);
+    }
+  }
+}
+
+namespace {
+// Integer division by zero and of the smallest i64 by -1 trap in hardware,
+// so both are caught first and reported to divisionErrorSymbol (for a
+// vector, the first lane doing either). They then evaluate to 0 and to the
+// smallest i64 (wrapping around, like the other operators) respectively.
+llvm::Value *divide(GenState &state, llvm::Value *L, llvm::Value *R) {
+  auto &builder = *state.builder;
+  llvm::Type *type = L->getType();
+  llvm::Value *zero = llvm::Constant::getNullValue(type);
+  llvm::Value *byZero = builder.CreateICmpEQ(R, zero, "byzero");
+  llvm::Value *overflows = builder.CreateAnd(
+      builder.CreateICmpEQ(L, llvm::ConstantInt::get(type, INT64_MIN, true)),
+      builder.CreateICmpEQ(R, llvm::ConstantInt::get(type, -1, true)),
+      "overflows");
+  llvm::Value *invalid = builder.CreateOr(byZero, overflows, "invalid");
+  llvm::Value *anyInvalid = invalid;
+  llvm::Value *lane = nullptr;
+  if (type->isVectorTy()) {
+    llvm::Value *bits = builder.CreateBitCast(
+        invalid, builder.getIntNTy(type->getVectorNumElements()));
+    anyInvalid = builder.CreateIsNotNull(bits, "anyinvalid");
+    lane = builder.CreateBinaryIntrinsic(llvm::Intrinsic::cttz, bits,
+                                         builder.getFalse());
+  }
+
+  llvm::Function *function = builder.GetInsertBlock()->getParent();
+  auto *errorBB =
+      llvm::BasicBlock::Create(*state.context, "diverror", function);
+  auto *divBB = llvm::BasicBlock::Create(*state.context, "div", function);
+  builder.CreateCondBr(
+      anyInvalid, errorBB, divBB,
+      llvm::MDBuilder(*state.context).createBranchWeights(1, 1 << 20));
+
+  builder.SetInsertPoint(errorBB);
+  llvm::Type *i64 = builder.getInt64Ty();
+  auto divisionError = state.llvmModule->getOrInsertFunction(
+      divisionErrorSymbol,
+      llvm::FunctionType::get(builder.getVoidTy(), {i64, i64}, false));
+  builder.CreateCall(divisionError,
+                     {lane ? builder.CreateExtractElement(L, lane) : L,
+                      lane ? builder.CreateExtractElement(R, lane) : R});
+  builder.CreateBr(divBB);
+
+  builder.SetInsertPoint(divBB);
+  llvm::Value *divisor =
+      builder.CreateSelect(invalid, llvm::ConstantInt::get(type, 1), R);
+  llvm::Value *quotient = builder.CreateSDiv(L, divisor, "divtmp");
+  return builder.CreateSelect(byZero, zero, quotient);
+}
+} // namespace
+
+llvm::Value *Binary::emit(GenState &state, llvm::Value *L, llvm::Value *R) {
   if (!L || !R) {
     throw std::runtime_error("exceptional failure in binary gen");
   }
 
+  Type type = commonType(Type::fromLLVM(L->getType()),
+                         Type::fromLLVM(R->getType()));
+  L = convert(state, L, type);
+  R = convert(state, R, type);
+
   // TODO: maybe not a switch (map of function pointers?)
+  if (type.isFloat()) {
+    switch (op) {
+    case '+':
+      return state.builder->CreateFAdd(L, R, "addtmp");
+    case '-':
+      return state.builder->CreateFSub(L, R, "subtmp");
+    case '*':
+      return state.builder->CreateFMul(L, R, "multmp");
+    case '/':
+      return state.builder->CreateFDiv(L, R, "divtmp");
+    case '<':
+      return state.builder->CreateFCmpULT(L, R, "cmptmp");
+    default:
+      throw std::runtime_error("unknown operation!");
+    }
+  }
+
   switch (op) {
   case '+':
-    return state.builder.CreateFAdd(L, R, "addtmp");
+    return state.builder->CreateAdd(L, R, "addtmp");
   case '-':
-    return state.builder.CreateFSub(L, R, "subtmp");
+    return state.builder->CreateSub(L, R, "subtmp");
   case '*':
-    return state.builder.CreateFMul(L, R, "multmp");
+    return state.builder->CreateMul(L, R, "multmp");
   case '/':
-    return state.builder.CreateFDiv(L, R, "divtmp");
+    return divide(state, L, R);
   case '<':
-    L = state.builder.CreateFCmpULT(L, R, "cmptmp");
-    return state.builder.CreateUIToFP(L, llvm::Type::getDoubleTy(state.context),
-                                      "booltmp");
+    return state.builder->CreateICmpSLT(L, R, "cmptmp");
   default:
     throw std::runtime_error("unknown operation!");
   }
@@ -87,50 +696,624 @@ Call::Call(const std::string &callee,
            std::vector<std::unique_ptr<ExprNode>> args)
     : callee(callee), args(std::move(args)) {}
 
+Call::~Call() { release(std::move(args)); }
+
+namespace {
+// Generates an argument of a builtin, a literal one as a value of type.
+llvm::Value *builtinArgument(GenState &state, ExprNode &arg,
+                             std::optional<Type> type = std::nullopt) {
+  auto *num = std::get_if<Number>(&arg);
+  if (num && type) {
+    return num->codegenAs(state, *type);
+  }
+  return std::visit([&](auto &node) { return node.codegen(state); }, arg);
+}
+
+// Lane numbers are literals, so that they can be checked here and become
+// immediates of the instructions using them.
+uint32_t laneIndex(const ExprNode &arg, unsigned limit) {
+  auto *num = std::get_if<Number>(&arg);
+  if (!num || num->val != std::trunc(num->val) || num->val < 0 ||
+      num->val >= limit) {
+    throw std::runtime_error("lane indices must be literals below " +
+                             std::to_string(limit));
+  }
+  return static_cast<uint32_t>(num->val);
+}
+
+llvm::Value *vectorArgument(GenState &state, ExprNode &arg,
+                            const std::string &builtin) {
+  llvm::Value *vector = builtinArgument(state, arg);
+  if (!Type::fromLLVM(vector->getType()).isVector()) {
+    throw std::runtime_error(builtin + " takes a vector");
+  }
+  return vector;
+}
+
+llvm::Value *shuffle(GenState &state, llvm::Value *lhs, llvm::Value *rhs,
+                     llvm::ArrayRef<uint32_t> mask) {
+  if (!rhs) {
+    rhs = llvm::UndefValue::get(lhs->getType());
+  }
+  return state.builder->CreateShuffleVector(
+      lhs, rhs, llvm::ConstantDataVector::get(*state.context, mask),
+      "shuffle");
+}
+
+// Folds the lanes of vector with op ('+', '<' for the minimum or '>' for the
+// maximum) pairwise: the upper half onto the lower until two lanes are left.
+// That keeps every step a vector instruction, but also means hsum adds in a
+// different order than a loop over the lanes would.
+llvm::Value *reduce(GenState &state, llvm::Value *vector, char op) {
+  Type type = Type::fromLLVM(vector->getType());
+  if (type.kind == Type::Bool) {
+    type.kind = Type::I64;
+    vector = convert(state, vector, type);
+  }
+  auto &b = *state.builder;
+  auto combine = [&](llvm::Value *L, llvm::Value *R) {
+    if (op == '+') {
+      return type.isFloat() ? b.CreateFAdd(L, R, "addtmp")
+                            : b.CreateAdd(L, R, "addtmp");
+    }
+    llvm::Value *lt = type.isFloat() ? b.CreateFCmpOLT(L, R, "cmptmp")
+                                     : b.CreateICmpSLT(L, R, "cmptmp");
+    return op == '<' ? b.CreateSelect(lt, L, R, "mintmp")
+                     : b.CreateSelect(lt, R, L, "maxtmp");
+  };
+  for (unsigned lanes = type.lanes; lanes > 2; lanes /= 2) {
+    std::vector<uint32_t> low;
+    std::vector<uint32_t> high;
+    for (unsigned i = 0; i < lanes / 2; ++i) {
+      low.push_back(i);
+      high.push_back(lanes / 2 + i);
+    }
+    vector = combine(shuffle(state, vector, nullptr, low),
+                     shuffle(state, vector, nullptr, high));
+  }
+  return combine(b.CreateExtractElement(vector, uint64_t{0}, "lane"),
+                 b.CreateExtractElement(vector, uint64_t{1}, "lane"));
+}
+
+// Returns nullptr for calls that aren't to a builtin after all.
+llvm::Value *codegenBuiltin(GenState &state, Call &call) {
+  const std::string &callee = call.callee;
+  auto &args = call.args;
+  auto &b = *state.builder;
+
+  // len(buffer); len of anything else is left to a function called len.
+  if (callee == "len") {
+    auto *var = args.size() == 1 ? std::get_if<Variable>(args[0].get())
+                                 : nullptr;
+    if (var) {
+      auto len = state.namedValues.find(lengthName(var->name));
+      if (len != state.namedValues.end()) {
+        return len->second;
+      }
+    }
+    return nullptr;
+  }
+
+  // f64x4(a, b, c, d) builds a vector from its lanes; f64x4(x) broadcasts a
+  // scalar or converts another vector of four lanes.
+  if (auto type = typeNamed(callee)) {
+    Type element = type->element();
+    if (args.size() == 1) {
+      return convert(state, builtinArgument(state, *args[0], element), *type);
+    }
+    if (args.size() != type->lanes) {
+      throw std::runtime_error("Incorrect # arguments passed");
+    }
+    llvm::Value *vector =
+        llvm::UndefValue::get(type->llvmType(*state.context));
+    for (size_t i = 0; i < args.size(); ++i) {
+      llvm::Value *lane =
+          convert(state, builtinArgument(state, *args[i], element), element);
+      vector = b.CreateInsertElement(vector, lane, i, "vectmp");
+    }
+    return vector;
+  }
+
+  if (callee == "hsum" || callee == "hmin" || callee == "hmax") {
+    if (args.size() != 1) {
+      throw std::runtime_error("Incorrect # arguments passed");
+    }
+    char op = callee == "hsum" ? '+' : callee == "hmin" ? '<' : '>';
+    return reduce(state, vectorArgument(state, *args[0], callee), op);
+  }
+
+  size_t minArgs = callee == "insert" ? 3 : 2;
+  if (args.size() < minArgs || (callee != "shuffle" && args.size() > minArgs)) {
+    throw std::runtime_error("Incorrect # arguments passed");
+  }
+  llvm::Value *vector = vectorArgument(state, *args[0], callee);
+  Type type = Type::fromLLVM(vector->getType());
+
+  // extract(v, lane)
+  if (callee == "extract") {
+    return b.CreateExtractElement(vector, laneIndex(*args[1], type.lanes),
+                                  "lane");
+  }
+
+  // insert(v, lane, x): v with lane replaced by x.
+  if (callee == "insert") {
+    uint32_t lane = laneIndex(*args[1], type.lanes);
+    llvm::Value *value = convert(
+        state, builtinArgument(state, *args[2], type.element()),
+        type.element());
+    return b.CreateInsertElement(vector, value, lane, "vectmp");
+  }
+
+  // shuffle(v, lanes...) picks lanes of v, shuffle(v, w, lanes...) of both
+  // (w's lanes are numbered after v's). Either way the result has as many
+  // lanes as were picked.
+  llvm::Value *second = nullptr;
+  size_t first = 1;
+  if (!std::holds_alternative<Number>(*args[1])) {
+    second = convert(state, vectorArgument(state, *args[1], callee), type);
+    first = 2;
+  }
+  std::vector<uint32_t> mask;
+  for (size_t i = first; i < args.size(); ++i) {
+    mask.push_back(laneIndex(*args[i], second ? 2 * type.lanes : type.lanes));
+  }
+  if (!Type::isLaneCount(static_cast<unsigned>(mask.size()))) {
+    throw std::runtime_error("shuffle must pick 2, 4, 8 or 16 lanes");
+  }
+  return shuffle(state, vector, second, mask);
+}
+} // namespace
+
 llvm::Value *Call::codegen(GenState &state) {
-  llvm::Function *calleeF = getFunction(callee, state);
+  NestingGuard guard(state);
+  setLocation(state, location);
+  if (isBuiltin(callee) && !state.functionProtos.count(callee)) {
+    if (llvm::Value *builtin = codegenBuiltin(state, *this)) {
+      return builtin;
+    }
+  }
 
+  llvm::Function *calleeF = nullptr;
+  constants_t constants;
+  auto protoIt = state.functionProtos.find(callee);
+  if (!state.specializations.empty() &&
+      protoIt != state.functionProtos.end() &&
+      protoIt->second->args.size() == args.size()) {
+    constants = constantArguments(*this, *protoIt->second);
+    auto spec =
+        state.specializations.find(specializationKey(callee, constants));
+    if (spec != state.specializations.end()) {
+      calleeF = state.llvmModule->getFunction(spec->second->symbolName(state));
+      if (!calleeF) {
+        calleeF = spec->second->codegen(state);
+      }
+    } else {
+      constants.clear();
+    }
+  }
   if (!calleeF) {
-    throw std::runtime_error("Unknown function referenced");
+    calleeF = getFunction(callee, state);
   }
 
-  if (calleeF->arg_size() != args.size()) {
-    throw std::runtime_error("Incorrect # arguments passed");
+  if (!calleeF) {
+    throw std::runtime_error("Unknown function referenced");
   }
 
   std::vector<llvm::Value *> argsV;
-  std::transform(args.begin(), args.end(), std::back_inserter(argsV),
-                 [&](const std::unique_ptr<ExprNode> &arg) {
-                   return std::visit(
-                       [&](auto &node) { return node.codegen(state); }, *arg);
-                 });
+  auto param = calleeF->arg_begin();
+  for (size_t i = 0; i < args.size(); ++i) {
+    // Bound into the specialization being called.
+    if (!constants.empty() && constants[i]) {
+      continue;
+    }
+    const auto &arg = args[i];
+    if (param == calleeF->arg_end()) {
+      throw std::runtime_error("Incorrect # arguments passed");
+    }
+    Type paramType = Type::fromLLVM((param++)->getType());
+    if (paramType.isBuffer()) {
+      // Buffers are passed on as they came in: pointer and length.
+      auto *var = std::get_if<Variable>(arg.get());
+      auto len = var ? state.namedValues.find(lengthName(var->name))
+                     : state.namedValues.end();
+      if (len == state.namedValues.end()) {
+        throw std::runtime_error("buffer arguments must be buffer parameters");
+      }
+      argsV.push_back(var->codegen(state));
+      argsV.push_back(len->second);
+      ++param;
+      continue;
+    }
+
+    llvm::Value *argV;
+    if (auto *num = std::get_if<Number>(arg.get())) {
+      argV = num->codegenAs(state, paramType);
+    } else {
+      argV = std::visit([&](auto &node) { return node.codegen(state); }, *arg);
+    }
+    argsV.push_back(convert(state, argV, paramType));
+  }
+  if (param != calleeF->arg_end()) {
+    throw std::runtime_error("Incorrect # arguments passed");
+  }
 
-  return state.builder.CreateCall(calleeF, argsV, "calltmp");
+  setLocation(state, location);
+  return state.builder->CreateCall(calleeF, argsV, "calltmp");
 }
 
 std::ostream &operator<<(std::ostream &out, const Call &call) {
   out << "Call{TBD}";
   return out;
 }
+
+If::If(std::unique_ptr<ExprNode> cond, std::unique_ptr<ExprNode> then,
+       std::unique_ptr<ExprNode> otherwise)
+    : cond(std::move(cond)), then(std::move(then)),
+      otherwise(std::move(otherwise)) {}
+
+If::~If() { release(cond, then, otherwise); }
+
+llvm::Value *If::codegen(GenState &state) {
+  NestingGuard guard(state);
+  auto codegenVisitor = [&](auto &val) { return val.codegen(state); };
+  llvm::Value *condV =
+      convert(state, std::visit(codegenVisitor, *cond), Type::Bool);
+
+  llvm::Function *function = state.builder->GetInsertBlock()->getParent();
+  auto *thenBB = llvm::BasicBlock::Create(*state.context, "then", function);
+  auto *elseBB = llvm::BasicBlock::Create(*state.context, "else", function);
+  auto *mergeBB = llvm::BasicBlock::Create(*state.context, "ifcont", function);
+  setLocation(state, location);
+  state.builder->CreateCondBr(condV, thenBB, elseBB);
+
+  // A literal branch takes on the type of the other one, so it is generated
+  // second. Either branch may end in a different block than it started in.
+  auto branch = [&](llvm::BasicBlock *block, ExprNode &node,
+                    llvm::Value *other) {
+    state.builder->SetInsertPoint(block);
+    auto *num = std::get_if<Number>(&node);
+    if (num && other) {
+      Type otherType = Type::fromLLVM(other->getType());
+      if (adoptsType(*num, otherType)) {
+        return num->codegenAs(state, otherType);
+      }
+    }
+    return std::visit(codegenVisitor, node);
+  };
+  llvm::Value *thenV;
+  llvm::Value *elseV;
+  llvm::BasicBlock *thenEnd;
+  llvm::BasicBlock *elseEnd;
+  if (std::holds_alternative<Number>(*then) &&
+      !std::holds_alternative<Number>(*otherwise)) {
+    elseV = branch(elseBB, *otherwise, nullptr);
+    elseEnd = state.builder->GetInsertBlock();
+    thenV = branch(thenBB, *then, elseV);
+    thenEnd = state.builder->GetInsertBlock();
+  } else {
+    thenV = branch(thenBB, *then, nullptr);
+    thenEnd = state.builder->GetInsertBlock();
+    elseV = branch(elseBB, *otherwise, thenV);
+    elseEnd = state.builder->GetInsertBlock();
+  }
+
+  Type thenType = Type::fromLLVM(thenV->getType());
+  Type elseType = Type::fromLLVM(elseV->getType());
+  Type type =
+      thenType == elseType ? thenType : commonType(thenType, elseType);
+  setLocation(state, location);
+  state.builder->SetInsertPoint(thenEnd);
+  thenV = convert(state, thenV, type);
+  state.builder->CreateBr(mergeBB);
+  state.builder->SetInsertPoint(elseEnd);
+  elseV = convert(state, elseV, type);
+  state.builder->CreateBr(mergeBB);
+
+  state.builder->SetInsertPoint(mergeBB);
+  llvm::PHINode *phi =
+      state.builder->CreatePHI(type.llvmType(*state.context), 2, "iftmp");
+  phi->addIncoming(thenV, thenEnd);
+  phi->addIncoming(elseV, elseEnd);
+  return phi;
+}
+
+std::ostream &operator<<(std::ostream &out, const If &expr) {
+  out << "If{cond: ";
+  std::visit([&](const auto &tkn) { out << tkn; }, *expr.cond);
+  out << ", then: ";
+  std::visit([&](const auto &tkn) { out << tkn; }, *expr.then);
+  out << ", else: ";
+  std::visit([&](const auto &tkn) { out << tkn; }, *expr.otherwise);
+  out << '}';
+  return out;
+}
+
+For::For(const std::string &varName, std::optional<Type> varType,
+         std::unique_ptr<ExprNode> start, std::unique_ptr<ExprNode> cond,
+         std::unique_ptr<ExprNode> step, std::unique_ptr<ExprNode> body)
+    : varName(varName), varType(varType), start(std::move(start)),
+      cond(std::move(cond)), step(std::move(step)), body(std::move(body)) {}
+
+For::~For() { release(start, cond, step, body); }
+
+llvm::Value *For::codegen(GenState &state) {
+  NestingGuard guard(state);
+  auto codegenVisitor = [&](auto &val) { return val.codegen(state); };
+  llvm::Value *startV;
+  auto *startNum = std::get_if<Number>(start.get());
+  if (startNum && varType) {
+    startV = startNum->codegenAs(state, *varType);
+  } else {
+    startV = std::visit(codegenVisitor, *start);
+  }
+  Type type = varType.value_or(Type::fromLLVM(startV->getType()));
+  if (type.kind == Type::Bool) {
+    type = Type::I64;
+  }
+  startV = convert(state, startV, type);
+  setLocation(state, location);
+
+  // The condition is tested in the header before every iteration, giving the
+  // canonical shape (preheader, header, latch) the loop passes look for.
+  llvm::BasicBlock *preheader = state.builder->GetInsertBlock();
+  llvm::Function *function = preheader->getParent();
+  auto *headerBB = llvm::BasicBlock::Create(*state.context, "loop", function);
+  auto *bodyBB = llvm::BasicBlock::Create(*state.context, "body", function);
+  auto *afterBB =
+      llvm::BasicBlock::Create(*state.context, "afterloop", function);
+  state.builder->CreateBr(headerBB);
+
+  state.builder->SetInsertPoint(headerBB);
+  llvm::PHINode *var =
+      state.builder->CreatePHI(type.llvmType(*state.context), 2, varName);
+  var->addIncoming(startV, preheader);
+
+  // The loop variable shadows anything of the same name for the loop only.
+  auto shadowed = state.namedValues.find(varName);
+  llvm::Value *oldVal =
+      shadowed != state.namedValues.end() ? shadowed->second : nullptr;
+  state.namedValues[varName] = var;
+
+  llvm::Value *condV =
+      convert(state, std::visit(codegenVisitor, *cond), Type::Bool);
+  state.builder->CreateCondBr(condV, bodyBB, afterBB);
+
+  state.builder->SetInsertPoint(bodyBB);
+  std::visit(codegenVisitor, *body);
+
+  llvm::Value *stepV;
+  auto *stepNum = step ? std::get_if<Number>(step.get()) : nullptr;
+  if (!step) {
+    stepV = Number(1.0).codegenAs(state, type);
+  } else if (stepNum && adoptsType(*stepNum, type)) {
+    stepV = stepNum->codegenAs(state, type);
+  } else {
+    stepV = convert(state, std::visit(codegenVisitor, *step), type);
+  }
+  setLocation(state, location);
+  llvm::Value *next = type.isFloat()
+                          ? state.builder->CreateFAdd(var, stepV, "nextvar")
+                          : state.builder->CreateAdd(var, stepV, "nextvar");
+  llvm::BranchInst *latch = state.builder->CreateBr(headerBB);
+  var->addIncoming(next, state.builder->GetInsertBlock());
+
+  // A distinct, self-referential loop ID: what loop transformation hints and
+  // optimization remarks attach to. Remarks take the loop's location from it.
+  std::vector<llvm::Metadata *> loopMD{nullptr};
+  if (auto *loc = latch->getDebugLoc().get()) {
+    loopMD.push_back(loc);
+  }
+  llvm::MDNode *loopID = llvm::MDNode::getDistinct(*state.context, loopMD);
+  loopID->replaceOperandWith(0, loopID);
+  latch->setMetadata(llvm::LLVMContext::MD_loop, loopID);
+
+  state.builder->SetInsertPoint(afterBB);
+  if (oldVal) {
+    state.namedValues[varName] = oldVal;
+  } else {
+    state.namedValues.erase(varName);
+  }
+
+  return llvm::Constant::getNullValue(llvm::Type::getDoubleTy(*state.context));
+}
+
+std::ostream &operator<<(std::ostream &out, const For &expr) {
+  out << "For{var: " << expr.varName << ", start: ";
+  std::visit([&](const auto &tkn) { out << tkn; }, *expr.start);
+  out << ", cond: ";
+  std::visit([&](const auto &tkn) { out << tkn; }, *expr.cond);
+  if (expr.step) {
+    out << ", step: ";
+    std::visit([&](const auto &tkn) { out << tkn; }, *expr.step);
+  }
+  out << ", body: ";
+  std::visit([&](const auto &tkn) { out << tkn; }, *expr.body);
+  out << '}';
+  return out;
+}
+
+Index::Index(const std::string &buffer, std::unique_ptr<ExprNode> index,
+             std::unique_ptr<ExprNode> value)
+    : buffer(buffer), index(std::move(index)), value(std::move(value)) {}
+
+Index::~Index() { release(index, value); }
+
+llvm::Value *Index::codegen(GenState &state) {
+  NestingGuard guard(state);
+  auto ptr = state.namedValues.find(buffer);
+  auto len = state.namedValues.find(lengthName(buffer));
+  if (ptr == state.namedValues.end() || len == state.namedValues.end()) {
+    throw std::runtime_error("Unknown buffer name");
+  }
+
+  auto codegenVisitor = [&](auto &val) { return val.codegen(state); };
+  llvm::Value *indexV;
+  if (auto *num = std::get_if<Number>(index.get())) {
+    indexV = num->codegenAs(state, Type::I64);
+  } else {
+    indexV = convert(state, std::visit(codegenVisitor, *index), Type::I64);
+  }
+  setLocation(state, location);
+
+  if (state.boundsChecks) {
+    // Unsigned, so negative indices are caught too.
+    llvm::Value *inBounds =
+        state.builder->CreateICmpULT(indexV, len->second, "inbounds");
+    llvm::Function *function = state.builder->GetInsertBlock()->getParent();
+    auto *failBB =
+        llvm::BasicBlock::Create(*state.context, "outofbounds", function);
+    auto *okBB = llvm::BasicBlock::Create(*state.context, "inbounds", function);
+    state.builder->CreateCondBr(inBounds, okBB, failBB);
+
+    state.builder->SetInsertPoint(failBB);
+    llvm::Type *i64 = llvm::Type::getInt64Ty(*state.context);
+    auto boundsError = state.llvmModule->getOrInsertFunction(
+        boundsErrorSymbol,
+        llvm::FunctionType::get(llvm::Type::getVoidTy(*state.context),
+                                {i64, i64}, false));
+    state.builder->CreateCall(boundsError, {indexV, len->second});
+    state.builder->CreateUnreachable();
+
+    state.builder->SetInsertPoint(okBB);
+  }
+
+  llvm::Type *f64 = llvm::Type::getDoubleTy(*state.context);
+  llvm::Value *element =
+      state.builder->CreateInBoundsGEP(f64, ptr->second, indexV, "element");
+  if (!value) {
+    return state.builder->CreateLoad(f64, element, "loadtmp");
+  }
+
+  llvm::Value *valueV =
+      convert(state, std::visit(codegenVisitor, *value), Type::F64);
+  setLocation(state, location);
+  state.builder->CreateStore(valueV, element);
+  return valueV;
+}
+
+std::ostream &operator<<(std::ostream &out, const Index &expr) {
+  out << "Index{buffer: " << expr.buffer << ", index: ";
+  std::visit([&](const auto &tkn) { out << tkn; }, *expr.index);
+  if (expr.value) {
+    out << ", value: ";
+    std::visit([&](const auto &tkn) { out << tkn; }, *expr.value);
+  }
+  out << '}';
+  return out;
+}
+
+void collectCallees(const ExprNode &node, std::vector<std::string> &callees) {
+  walk(node, [&](const ExprNode &node) {
+    if (auto *call = std::get_if<Call>(&node)) {
+      callees.push_back(call->callee);
+    }
+  });
+}
+
+void collectCalls(const ExprNode &node, std::vector<const Call *> &calls) {
+  walk(node, [&](const ExprNode &node) {
+    if (auto *call = std::get_if<Call>(&node)) {
+      calls.push_back(call);
+    }
+  });
+}
+
+void measure(const ExprNode &node, Footprint &footprint) {
+  walk(node, [&](const ExprNode &node) {
+    ++footprint.count;
+    footprint.bytes += sizeof(ExprNode);
+    if (auto *var = std::get_if<Variable>(&node)) {
+      footprint.bytes += var->name.capacity();
+    } else if (auto *call = std::get_if<Call>(&node)) {
+      footprint.bytes += call->callee.capacity() +
+                         call->args.capacity() * sizeof(call->args[0]);
+    } else if (auto *forExpr = std::get_if<For>(&node)) {
+      footprint.bytes += forExpr->varName.capacity();
+    } else if (auto *index = std::get_if<Index>(&node)) {
+      footprint.bytes += index->buffer.capacity();
+    }
+  });
+}
+
+// Everything a node holds besides its children comes before them, which
+// keeps the encoding unambiguous.
+void fingerprint(const ExprNode &node, std::string &key) {
+  walk(node, [&](const ExprNode &node) {
+    key += static_cast<char>(node.index());
+    if (auto *num = std::get_if<Number>(&node)) {
+      appendBytes(key, &num->val, sizeof(num->val));
+    } else if (auto *var = std::get_if<Variable>(&node)) {
+      appendName(key, var->name);
+    } else if (auto *bin = std::get_if<Binary>(&node)) {
+      key += bin->op;
+    } else if (auto *call = std::get_if<Call>(&node)) {
+      appendName(key, call->callee);
+      uint32_t numArgs = static_cast<uint32_t>(call->args.size());
+      appendBytes(key, &numArgs, sizeof(numArgs));
+    } else if (auto *forExpr = std::get_if<For>(&node)) {
+      appendName(key, forExpr->varName);
+      key += forExpr->varType ? 't' : '-';
+      if (forExpr->varType) {
+        appendType(key, *forExpr->varType);
+      }
+      key += forExpr->step ? 's' : '-';
+    } else if (auto *index = std::get_if<Index>(&node)) {
+      appendName(key, index->buffer);
+      key += index->value ? 'v' : '-';
+    }
+  });
+}
 } // namespace expr
 
 Prototype::Prototype(const std::string &name, std::vector<std::string> args,
-                     bool isExtern)
-    : name(name), args(std::move(args)), isExtern(isExtern) {}
+                     bool isExtern, std::vector<Type> argTypes, Type retType)
+    : name(name), args(std::move(args)), isExtern(isExtern),
+      argTypes(std::move(argTypes)), retType(retType) {
+  this->argTypes.resize(this->args.size(), Type::F64);
+}
 
-llvm::Function *Prototype::codegen(GenState &state) {
-  std::vector<llvm::Type *> doubles(args.size(),
-                                    llvm::Type::getDoubleTy(state.context));
+void Prototype::measure(Footprint &footprint) const {
+  ++footprint.count;
+  footprint.bytes += sizeof(Prototype) + name.capacity() +
+                     args.capacity() * sizeof(args[0]) +
+                     argTypes.capacity() * sizeof(argTypes[0]);
+  for (const auto &arg : args) {
+    footprint.bytes += arg.capacity();
+  }
+}
 
-  llvm::FunctionType *fT = llvm::FunctionType::get(
-      llvm::Type::getDoubleTy(state.context), doubles, false);
+void Prototype::fingerprint(std::string &key) const {
+  key += isExtern ? 'e' : 'd';
+  uint32_t numArgs = static_cast<uint32_t>(args.size());
+  appendBytes(key, &numArgs, sizeof(numArgs));
+  for (size_t i = 0; i < args.size(); ++i) {
+    appendName(key, args[i]);
+    appendType(key, argTypes[i]);
+  }
+  appendType(key, retType);
+  key += fpMode ? static_cast<char>(*fpMode) : '-';
+}
 
-  llvm::Function *f = llvm::Function::Create(
-      fT, llvm::Function::ExternalLinkage, name, state.llvmModule.get());
+llvm::Function *Prototype::codegen(GenState &state) {
+  if (retType.isBuffer()) {
+    throw std::runtime_error("functions cannot return buffers");
+  }
 
-  size_t i = 0;
-  for (auto &arg : f->args()) {
-    arg.setName(args[i++]);
+  llvm::FunctionType *fT = functionType(*state.context);
+  llvm::Function *f =
+      llvm::Function::Create(fT, llvm::Function::ExternalLinkage,
+                             symbolName(state), state.llvmModule.get());
+
+  auto arg = f->arg_begin();
+  for (size_t i = 0; i < args.size(); ++i, ++arg) {
+    arg->setName(args[i]);
+    if (argTypes[i].isBuffer()) {
+      // Buffers must not overlap, which is what lets loops over them be
+      // vectorized without runtime alias checks.
+      arg->addAttr(llvm::Attribute::NoAlias);
+      arg->addAttr(llvm::Attribute::NoCapture);
+      (++arg)->setName(lengthName(args[i]));
+    }
   }
 
   if (isExtern) {
@@ -140,26 +1323,92 @@ llvm::Function *Prototype::codegen(GenState &state) {
   return f;
 }
 
+llvm::FunctionType *
+Prototype::functionType(llvm::LLVMContext &context) const {
+  std::vector<llvm::Type *> params;
+  for (const auto &type : argTypes) {
+    params.push_back(type.llvmType(context));
+    if (type.isBuffer()) {
+      params.push_back(llvm::Type::getInt64Ty(context));
+    }
+  }
+  return llvm::FunctionType::get(retType.llvmType(context), params, false);
+}
+
+bool Prototype::isUntyped() const noexcept {
+  return retType == Type::F64 &&
+         std::all_of(argTypes.begin(), argTypes.end(),
+                     [](const Type &type) { return type == Type::F64; });
+}
+
+std::string Prototype::symbolName(const GenState &state) const {
+  return isExtern ? name : state.symbolPrefix + name;
+}
+
 Function::Function(std::unique_ptr<Prototype> proto,
                    std::unique_ptr<expr::ExprNode> body)
     : proto(std::move(proto)), body(std::move(body)) {}
 
-llvm::Function *Function::codegen(GenState &state) {
-  auto &p = *proto;
-  state.functionProtos[proto->name] = std::move(proto);
-
-  llvm::Function *function = getFunction(p.name, state);
-  if (!function) {
-    throw std::runtime_error("failed to generate function prototype");
+namespace {
+// Gives function a compile unit of its own (modules hold one definition
+// each) and a subprogram at proto's location, which every instruction starts
+// out with.
+std::unique_ptr<llvm::DIBuilder> addDebugInfo(GenState &state,
+                                              llvm::Function *function,
+                                              const Prototype &proto) {
+  llvm::Module &module = *function->getParent();
+  if (!module.getModuleFlag("Debug Info Version")) {
+    module.addModuleFlag(llvm::Module::Warning, "Debug Info Version",
+                         llvm::DEBUG_METADATA_VERSION);
   }
+  auto debugInfo = std::make_unique<llvm::DIBuilder>(module);
+  llvm::DIFile *file = debugInfo->createFile("kaleidoscope", ".");
+  debugInfo->createCompileUnit(llvm::dwarf::DW_LANG_C, file, "kjit", true, "",
+                               0, "", llvm::DICompileUnit::LineTablesOnly);
+  llvm::DISubprogram *subprogram = debugInfo->createFunction(
+      file, proto.name, function->getName(), file, proto.location.line,
+      debugInfo->createSubroutineType(debugInfo->getOrCreateTypeArray({})),
+      proto.location.line, llvm::DINode::FlagPrototyped,
+      llvm::DISubprogram::SPFlagDefinition |
+          llvm::DISubprogram::SPFlagOptimized);
+  function->setSubprogram(subprogram);
+  state.builder->SetCurrentDebugLocation(
+      llvm::DILocation::get(*state.context, proto.location.line,
+                            proto.location.column, subprogram));
+  return debugInfo;
+}
 
+// Emits body into function, which was declared from proto with the
+// parameters set in constants left out.
+void emitBody(GenState &state, llvm::Function *function, const Prototype &proto,
+              expr::ExprNode &body, const constants_t &constants) {
   if (!function->empty()) {
     throw std::runtime_error("Function cannot be redefined");
   }
 
   llvm::BasicBlock *bB =
-      llvm::BasicBlock::Create(state.context, "entry", function);
-  state.builder.SetInsertPoint(bB);
+      llvm::BasicBlock::Create(*state.context, "entry", function);
+  state.builder->SetInsertPoint(bB);
+  std::unique_ptr<llvm::DIBuilder> debugInfo;
+  if (state.debugLocations) {
+    debugInfo = addDebugInfo(state, function, proto);
+  }
+  // Nothing generated later must point into this function.
+  auto finishDebugInfo = [&] {
+    if (debugInfo) {
+      state.builder->SetCurrentDebugLocation(llvm::DebugLoc());
+      debugInfo->finalize();
+      debugInfo.reset();
+    }
+  };
+  applyFPMode(state, *function, proto.fpMode.value_or(state.fpMode));
+  if (state.preferVectorWidth) {
+    function->addFnAttr("prefer-vector-width",
+                        std::to_string(state.preferVectorWidth));
+  }
+  if (state.framePointers) {
+    function->addFnAttr("frame-pointer", "all");
+  }
 
   state.namedValues.clear();
   for (auto &arg : function->args()) {
@@ -167,19 +1416,86 @@ llvm::Function *Function::codegen(GenState &state) {
   }
 
   try {
+    for (size_t i = 0; i < constants.size(); ++i) {
+      if (constants[i]) {
+        Type type = proto.argTypes[i];
+        state.namedValues[proto.args[i]] = convert(
+            state, expr::Number(*constants[i]).codegenAs(state, type), type);
+      }
+    }
+
     llvm::Value *retVal =
-        std::visit([&](auto &ret) { return ret.codegen(state); }, *body);
-    state.builder.CreateRet(retVal);
+        std::visit([&](auto &ret) { return ret.codegen(state); }, body);
+    state.builder->CreateRet(convert(state, retVal, proto.retType));
+    finishDebugInfo();
     llvm::verifyFunction(*function);
+    inlineHostBodies(*function);
 
     if (state.optPasses) {
       state.optPasses->run(*function);
     }
-
-    return function;
-  } catch (const std::exception &e) {
+  } catch (...) {
+    finishDebugInfo();
     function->eraseFromParent();
-    throw e;
+    throw;
+  }
+}
+} // namespace
+
+llvm::Function *Function::codegen(GenState &state) {
+  auto &p = *proto;
+  state.functionProtos[proto->name] = std::move(proto);
+
+  llvm::Function *function = getFunction(p.name, state);
+  if (!function) {
+    throw std::runtime_error("failed to generate function prototype");
   }
+
+  emitBody(state, function, p, *body, {});
+  return function;
+}
+
+constants_t constantArguments(const expr::Call &call, const Prototype &proto) {
+  constants_t constants(proto.args.size());
+  for (size_t i = 0; i < constants.size() && i < call.args.size(); ++i) {
+    auto *num = std::get_if<expr::Number>(call.args[i].get());
+    if (num && !proto.argTypes[i].isBuffer()) {
+      constants[i] = num->val;
+    }
+  }
+  return constants;
+}
+
+std::string specializationKey(const std::string &callee,
+                              const constants_t &constants) {
+  std::string key;
+  appendName(key, callee);
+  for (const auto &constant : constants) {
+    key += constant ? 'c' : '-';
+    if (constant) {
+      appendBytes(key, &*constant, sizeof(*constant));
+    }
+  }
+  return key;
+}
+
+llvm::Function *codegenSpecialization(GenState &state, const Prototype &proto,
+                                      expr::ExprNode &body,
+                                      const std::string &name,
+                                      const constants_t &constants) {
+  Prototype specialized(name, {}, false, {}, proto.retType);
+  specialized.fpMode = proto.fpMode;
+  for (size_t i = 0; i < proto.args.size(); ++i) {
+    if (!constants[i]) {
+      specialized.args.push_back(proto.args[i]);
+      specialized.argTypes.push_back(proto.argTypes[i]);
+    }
+  }
+
+  llvm::Function *function = specialized.codegen(state);
+  emitBody(state, function, proto, body, constants);
+  state.specializations[specializationKey(proto.name, constants)] =
+      std::make_unique<Prototype>(std::move(specialized));
+  return function;
 }
 } // namespace ast
@@ -0,0 +1,446 @@
+#include "bytecode.hpp"
+
+#include <algorithm>
+
+namespace {
+double callNative(void *address, size_t arity, const double *a) {
+  switch (arity) {
+  case 0:
+    return reinterpret_cast<double (*)()>(address)();
+  case 1:
+    return reinterpret_cast<double (*)(double)>(address)(a[0]);
+  case 2:
+    return reinterpret_cast<double (*)(double, double)>(address)(a[0], a[1]);
+  case 3:
+    return reinterpret_cast<double (*)(double, double, double)>(address)(
+        a[0], a[1], a[2]);
+  case 4:
+    return reinterpret_cast<double (*)(double, double, double, double)>(
+        address)(a[0], a[1], a[2], a[3]);
+  case 5:
+    return reinterpret_cast<double (*)(double, double, double, double,
+                                       double)>(address)(a[0], a[1], a[2],
+                                                         a[3], a[4]);
+  case 6:
+    return reinterpret_cast<double (*)(double, double, double, double, double,
+                                       double)>(address)(a[0], a[1], a[2],
+                                                         a[3], a[4], a[5]);
+  default:
+    throw std::runtime_error("too many arguments for a native call");
+  }
+}
+} // namespace
+
+namespace bytecode {
+// Lowers an expression tree onto registers. Arguments live in the first
+// registers of a frame and temporaries are allocated stack-like above them,
+// so the arguments of a call always occupy the top registers of the caller
+// and become the bottom registers of the callee's frame.
+class Compiler {
+public:
+  Compiler(Interpreter &interp, Chunk &chunk,
+           const std::vector<std::string> &args,
+           std::vector<std::string> &callees)
+      : interp(interp), chunk(chunk), callees(callees) {
+    chunk.arity = args.size();
+    for (const auto &arg : args) {
+      vars[arg] = alloc();
+    }
+  }
+
+  bool compile(const ast::expr::ExprNode &body) {
+    auto reg = expr(body);
+    if (!reg) {
+      return false;
+    }
+    emit(Op::Ret, 0, *reg, 0);
+    return true;
+  }
+
+private:
+  uint32_t alloc() {
+    uint32_t reg = top++;
+    chunk.numRegs = std::max(chunk.numRegs, top);
+    return reg;
+  }
+
+  void emit(Op op, uint32_t dst, uint32_t a, uint32_t b) {
+    chunk.code.push_back({op, dst, a, b});
+  }
+
+  std::optional<uint32_t> expr(const ast::expr::ExprNode &node) {
+    if (auto *num = std::get_if<ast::expr::Number>(&node)) {
+      uint32_t dst = alloc();
+      chunk.constants.push_back(num->val);
+      emit(Op::LoadConst, dst,
+           static_cast<uint32_t>(chunk.constants.size() - 1), 0);
+      return dst;
+    }
+    if (auto *var = std::get_if<ast::expr::Variable>(&node)) {
+      auto it = vars.find(var->name);
+      if (it == vars.end()) {
+        throw std::runtime_error("Unknown variable name");
+      }
+      return it->second;
+    }
+    if (auto *bin = std::get_if<ast::expr::Binary>(&node)) {
+      return binary(*bin);
+    }
+    // Calls and conditionals recurse. Nesting deeper than the JIT allows is
+    // left to it, to be refused there.
+    if (nesting == ast::maxCodegenNesting) {
+      return std::nullopt;
+    }
+    std::optional<uint32_t> reg;
+    ++nesting;
+    if (auto *c = std::get_if<ast::expr::Call>(&node)) {
+      reg = call(*c);
+    } else if (auto *ifExpr = std::get_if<ast::expr::If>(&node)) {
+      reg = conditional(*ifExpr);
+    }
+    --nesting;
+    return reg;
+  }
+
+  static Op opcode(char op) {
+    switch (op) {
+    case '+':
+      return Op::Add;
+    case '-':
+      return Op::Sub;
+    case '*':
+      return Op::Mul;
+    case '/':
+      return Op::Div;
+    case '<':
+      return Op::Lt;
+    default:
+      throw std::runtime_error("unknown operation!");
+    }
+  }
+
+  // Trees of binary operators are walked with an explicit stack, like
+  // Binary::codegen does, so deep formulas don't overflow the native one.
+  std::optional<uint32_t> binary(const ast::expr::Binary &root) {
+    struct Frame {
+      Frame(const ast::expr::Binary *node, uint32_t saved)
+          : node(node), saved(saved) {}
+
+      const ast::expr::Binary *node;
+      uint32_t saved;
+      uint32_t operands[2] = {0, 0};
+      int done = 0;
+    };
+    std::vector<Frame> frames;
+    frames.emplace_back(&root, top);
+    std::optional<uint32_t> result;
+    while (true) {
+      auto &frame = frames.back();
+      if (result) {
+        frame.operands[frame.done++] = *result;
+        result.reset();
+      }
+      if (frame.done == 2) {
+        Op op = opcode(frame.node->op);
+        top = frame.saved;
+        uint32_t dst = alloc();
+        emit(op, dst, frame.operands[0], frame.operands[1]);
+        frames.pop_back();
+        if (frames.empty()) {
+          return dst;
+        }
+        result = dst;
+        continue;
+      }
+
+      const auto &operand =
+          frame.done == 0 ? *frame.node->lhs : *frame.node->rhs;
+      if (auto *bin = std::get_if<ast::expr::Binary>(&operand)) {
+        frames.emplace_back(bin, top);
+        continue;
+      }
+      auto reg = expr(operand);
+      if (!reg) {
+        return std::nullopt;
+      }
+      frame.operands[frame.done++] = *reg;
+    }
+  }
+
+  std::optional<uint32_t> call(const ast::expr::Call &call) {
+    auto index = interp.lookup(call.callee);
+    if (!index) {
+      return std::nullopt;
+    }
+    if (interp.functions[*index].arity != call.args.size()) {
+      throw std::runtime_error("Incorrect # arguments passed");
+    }
+    callees.push_back(call.callee);
+
+    uint32_t base = top;
+    for (size_t i = 0; i < call.args.size(); ++i) {
+      alloc();
+    }
+    for (size_t i = 0; i < call.args.size(); ++i) {
+      auto reg = expr(*call.args[i]);
+      if (!reg) {
+        return std::nullopt;
+      }
+      uint32_t argReg = base + static_cast<uint32_t>(i);
+      if (*reg != argReg) {
+        emit(Op::Move, argReg, *reg, 0);
+      }
+      top = base + static_cast<uint32_t>(call.args.size());
+    }
+
+    top = base;
+    uint32_t dst = alloc();
+    emit(Op::Call, dst, *index, base);
+    return dst;
+  }
+
+  std::optional<uint32_t> conditional(const ast::expr::If &ifExpr) {
+    uint32_t saved = top;
+    auto cond = expr(*ifExpr.cond);
+    if (!cond) {
+      return std::nullopt;
+    }
+    // The condition is read before either branch writes dst.
+    top = saved;
+    uint32_t dst = alloc();
+
+    size_t toElse = chunk.code.size();
+    emit(Op::JumpIfFalse, 0, *cond, 0);
+    if (!branch(*ifExpr.then, dst)) {
+      return std::nullopt;
+    }
+    size_t toEnd = chunk.code.size();
+    emit(Op::Jump, 0, 0, 0);
+    chunk.code[toElse].b = static_cast<uint32_t>(chunk.code.size());
+    if (!branch(*ifExpr.otherwise, dst)) {
+      return std::nullopt;
+    }
+    chunk.code[toEnd].b = static_cast<uint32_t>(chunk.code.size());
+    return dst;
+  }
+
+  bool branch(const ast::expr::ExprNode &node, uint32_t dst) {
+    auto reg = expr(node);
+    if (!reg) {
+      return false;
+    }
+    if (*reg != dst) {
+      emit(Op::Move, dst, *reg, 0);
+    }
+    top = dst + 1;
+    return true;
+  }
+
+  Interpreter &interp;
+  Chunk &chunk;
+  std::vector<std::string> &callees;
+  std::unordered_map<std::string, uint32_t> vars;
+  uint32_t top = 0;
+  unsigned nesting = 0;
+};
+
+Interpreter::Interpreter(native_resolver_t resolveNative, tier_up_t tierUp,
+                         uint64_t tierUpThreshold)
+    : resolveNative(std::move(resolveNative)), tierUp(std::move(tierUp)),
+      tierUpThreshold(tierUpThreshold) {}
+
+bool Interpreter::define(const ast::Function &function) {
+  const auto &proto = *function.proto;
+  if (!proto.isUntyped()) {
+    return false;
+  }
+
+  std::optional<Entry> previous;
+  auto it = functionIndices.find(proto.name);
+  uint32_t index;
+  if (it != functionIndices.end()) {
+    index = it->second;
+    previous = std::move(functions[index]);
+  } else {
+    index = static_cast<uint32_t>(functions.size());
+    functions.emplace_back();
+    functionIndices[proto.name] = index;
+  }
+
+  // Registered before compiling the body so recursive calls resolve.
+  functions[index] = Entry{};
+  functions[index].name = proto.name;
+  functions[index].arity = proto.args.size();
+  functions[index].defined = true;
+
+  auto rollback = [&] {
+    if (previous) {
+      functions[index] = std::move(*previous);
+    } else {
+      functions[index].defined = false;
+      functionIndices.erase(proto.name);
+    }
+  };
+
+  Chunk chunk;
+  std::vector<std::string> callees;
+  bool compiled;
+  try {
+    compiled = Compiler(*this, chunk, proto.args, callees)
+                   .compile(*function.body);
+  } catch (...) {
+    rollback();
+    throw;
+  }
+  if (!compiled) {
+    rollback();
+    return false;
+  }
+
+  functions[index].chunk = std::move(chunk);
+  functions[index].callees = std::move(callees);
+  return true;
+}
+
+std::optional<double>
+Interpreter::evaluate(const ast::expr::ExprNode &expr) {
+  Chunk chunk;
+  std::vector<std::string> callees;
+  if (!Compiler(*this, chunk, {}, callees).compile(expr)) {
+    return std::nullopt;
+  }
+
+  size_t base = stack.size();
+  try {
+    return execute(chunk, base);
+  } catch (...) {
+    stack.resize(base);
+    throw;
+  }
+}
+
+void Interpreter::setNative(const std::string &name, void *address) {
+  auto it = functionIndices.find(name);
+  if (it != functionIndices.end()) {
+    functions[it->second].native = address;
+  }
+}
+
+bool Interpreter::isInterpreted(const std::string &name) const {
+  auto it = functionIndices.find(name);
+  return it != functionIndices.end() && functions[it->second].defined &&
+         !functions[it->second].native;
+}
+
+const std::vector<std::string> &
+Interpreter::callees(const std::string &name) const {
+  static const std::vector<std::string> none;
+  auto it = functionIndices.find(name);
+  return it != functionIndices.end() ? functions[it->second].callees : none;
+}
+
+std::optional<uint32_t> Interpreter::lookup(const std::string &name) {
+  auto it = functionIndices.find(name);
+  if (it != functionIndices.end()) {
+    return it->second;
+  }
+
+  auto native = resolveNative(name);
+  if (!native) {
+    throw std::runtime_error("Unknown function referenced");
+  }
+  if (!native->untyped || native->arity > maxNativeArity) {
+    return std::nullopt;
+  }
+
+  Entry entry;
+  entry.name = name;
+  entry.arity = native->arity;
+  entry.native = native->address;
+  functions.push_back(std::move(entry));
+  uint32_t index = static_cast<uint32_t>(functions.size() - 1);
+  functionIndices[name] = index;
+  return index;
+}
+
+double Interpreter::call(uint32_t index, size_t argBase) {
+  {
+    Entry &fn = functions[index];
+    if (!fn.native && tierUp && !fn.tierUpFailed &&
+        fn.arity <= maxNativeArity && ++fn.calls >= tierUpThreshold) {
+      std::string name = fn.name;
+      void *address = tierUp(name);
+      if (address) {
+        functions[index].native = address;
+      } else {
+        functions[index].tierUpFailed = true;
+      }
+    }
+  }
+
+  const Entry &fn = functions[index];
+  if (fn.native) {
+    return callNative(fn.native, fn.arity, stack.data() + argBase);
+  }
+  return execute(fn.chunk, argBase);
+}
+
+double Interpreter::execute(const Chunk &chunk, size_t base) {
+  // A frame may overlap the caller's dead registers above the arguments, so
+  // only ever grow the stack and restore the caller's size on return.
+  size_t callerSize = stack.size();
+  if (stack.size() < base + chunk.numRegs) {
+    stack.resize(base + chunk.numRegs);
+  }
+
+  size_t pc = 0;
+  while (pc < chunk.code.size()) {
+    const Instr &in = chunk.code[pc++];
+    double *r = stack.data() + base;
+    switch (in.op) {
+    case Op::LoadConst:
+      r[in.dst] = chunk.constants[in.a];
+      break;
+    case Op::Move:
+      r[in.dst] = r[in.a];
+      break;
+    case Op::Add:
+      r[in.dst] = r[in.a] + r[in.b];
+      break;
+    case Op::Sub:
+      r[in.dst] = r[in.a] - r[in.b];
+      break;
+    case Op::Mul:
+      r[in.dst] = r[in.a] * r[in.b];
+      break;
+    case Op::Div:
+      r[in.dst] = r[in.a] / r[in.b];
+      break;
+    case Op::Lt:
+      // Matches the JIT's unordered comparison: NaN operands compare true.
+      r[in.dst] = !(r[in.a] >= r[in.b]) ? 1.0 : 0.0;
+      break;
+    case Op::Call: {
+      double result = call(in.a, base + in.b);
+      stack[base + in.dst] = result;
+      break;
+    }
+    case Op::Jump:
+      pc = in.b;
+      break;
+    case Op::JumpIfFalse:
+      // Like the JIT's conversion to bool, NaN counts as true.
+      if (r[in.a] == 0.0) {
+        pc = in.b;
+      }
+      break;
+    case Op::Ret: {
+      double result = r[in.a];
+      stack.resize(callerSize);
+      return result;
+    }
+    }
+  }
+  throw std::runtime_error("bytecode chunk ended without returning");
+}
+} // namespace bytecode
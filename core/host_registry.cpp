@@ -0,0 +1,31 @@
+#include "host_registry.hpp"
+
+#include <algorithm>
+
+namespace host {
+bool Function::isUntyped() const noexcept {
+  return retType == ast::Type::F64 &&
+         std::all_of(argTypes.begin(), argTypes.end(), [](const ast::Type &t) {
+           return t == ast::Type::F64;
+         });
+}
+
+void Registry::add(Function function) {
+  if (!function.address) {
+    throw std::runtime_error("host function " + function.name +
+                             " has no address");
+  }
+  std::string name = function.name;
+  entries[name] = std::move(function);
+}
+
+const Function *Registry::find(const std::string &name) const {
+  auto it = entries.find(name);
+  return it != entries.end() ? &it->second : nullptr;
+}
+
+const std::unordered_map<std::string, Function> &
+Registry::functions() const noexcept {
+  return entries;
+}
+} // namespace host
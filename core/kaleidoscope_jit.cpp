@@ -1,44 +1,244 @@
 #include "kaleidoscope_jit.hpp"
 
+#include "perf_map_listener.hpp"
+
+#include "llvm/Support/ErrorHandling.h"
+
 namespace llvm {
 namespace orc {
+namespace {
+// Tallies the sections the linker allocates for one module.
+class CountingMemoryManager : public SectionMemoryManager {
+public:
+  CountingMemoryManager(std::shared_ptr<KaleidoscopeJIT::SectionUsage> usage)
+      : usage(std::move(usage)) {}
+
+  uint8_t *allocateCodeSection(uintptr_t size, unsigned alignment,
+                               unsigned sectionID,
+                               StringRef sectionName) override {
+    ++usage->codeSections;
+    usage->codeBytes += size;
+    return SectionMemoryManager::allocateCodeSection(size, alignment,
+                                                     sectionID, sectionName);
+  }
+
+  uint8_t *allocateDataSection(uintptr_t size, unsigned alignment,
+                               unsigned sectionID, StringRef sectionName,
+                               bool isReadOnly) override {
+    ++usage->dataSections;
+    usage->dataBytes += size;
+    return SectionMemoryManager::allocateDataSection(
+        size, alignment, sectionID, sectionName, isReadOnly);
+  }
+
+private:
+  std::shared_ptr<KaleidoscopeJIT::SectionUsage> usage;
+};
+
+// EngineBuilder on its own targets a generic CPU of the host's architecture.
+TargetMachine *selectTarget(const std::string &cpu,
+                            const std::vector<std::string> &features) {
+  std::string cpuName = cpu;
+  std::vector<std::string> attrs;
+  if (cpuName.empty()) {
+    cpuName = sys::getHostCPUName().str();
+    StringMap<bool> hostFeatures;
+    if (sys::getHostCPUFeatures(hostFeatures)) {
+      for (const auto &feature : hostFeatures) {
+        attrs.push_back((feature.second ? "+" : "-") + feature.first().str());
+      }
+    }
+  }
+  attrs.insert(attrs.end(), features.begin(), features.end());
+  return EngineBuilder().setMCPU(cpuName).setMAttrs(attrs).selectTarget();
+}
+
+// Where stubs with no definition behind them lead, so that a call through
+// one stops the process with a message rather than jumping to address 0.
+[[noreturn]] void calledUndefinedStub() {
+  report_fatal_error("called a JIT function that has no definition", false);
+}
+
+JITTargetAddress undefinedStubTarget() {
+  return pointerToJITTargetAddress(&calledUndefinedStub);
+}
+} // namespace
 
-KaleidoscopeJIT::KaleidoscopeJIT()
+KaleidoscopeJIT::KaleidoscopeJIT(const std::string &cpu,
+                                 const std::vector<std::string> &features)
     : resolver(createLegacyLookupResolver(
           es,
           [this](StringRef Name) {
             return findMangledSymbol(std::string(Name));
           },
           [](Error Err) { cantFail(std::move(Err), "lookupFlags failed"); })),
-      tm(EngineBuilder().selectTarget()), dl(tm->createDataLayout()),
+      targetCpu(cpu), targetFeatures(features),
+      tm(selectTarget(cpu, features)), dl(tm->createDataLayout()),
       objectLayer(AcknowledgeORCv1Deprecation, es,
-                  [this](VModuleKey) {
+                  [this](VModuleKey k) {
+                    auto usage = std::make_shared<SectionUsage>();
+                    sectionUsage[k] = usage;
                     return ObjLayerT::Resources{
-                        std::make_shared<SectionMemoryManager>(), resolver};
+                        std::make_shared<CountingMemoryManager>(usage),
+                        resolver};
+                  },
+                  nullptr,
+                  [this](VModuleKey k, const object::ObjectFile &obj,
+                         const RuntimeDyld::LoadedObjectInfo &info) {
+                    notifyObjectLoaded(k, obj, info);
+                  },
+                  [this](VModuleKey k, const object::ObjectFile &obj) {
+                    notifyObjectFreed(k, obj);
                   }),
       compileLayer(AcknowledgeORCv1Deprecation, objectLayer,
-                   SimpleCompiler(*tm)) {
+                   SimpleCompiler(*tm)),
+      stubs(createLocalIndirectStubsManagerBuilder(tm->getTargetTriple())()) {
   llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
 }
 
 TargetMachine &KaleidoscopeJIT::getTargetMachine() { return *tm; }
 
+std::unique_ptr<TargetMachine> KaleidoscopeJIT::createTargetMachine() {
+  return std::unique_ptr<TargetMachine>(
+      selectTarget(targetCpu, targetFeatures));
+}
+
 VModuleKey KaleidoscopeJIT::addModule(std::unique_ptr<Module> M) {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
   auto K = es.allocateVModule();
   cantFail(compileLayer.addModule(K, std::move(M)));
   moduleKeys.push_back(K);
   return K;
 }
 
+void KaleidoscopeJIT::printAssembly(Module &m, raw_pwrite_stream &out) {
+  // The target machine is shared with the compile layer.
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  legacy::PassManager passes;
+  if (tm->addPassesToEmitFile(passes, out, nullptr, CGFT_AssemblyFile)) {
+    throw std::runtime_error("target cannot emit assembly");
+  }
+  passes.run(m);
+}
+
 void KaleidoscopeJIT::removeModule(VModuleKey K) {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
   moduleKeys.erase(find(moduleKeys, K));
+  sectionUsage.erase(K);
   cantFail(compileLayer.removeModule(K));
 }
 
 JITSymbol KaleidoscopeJIT::findSymbol(const std::string Name) {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
   return findMangledSymbol(mangle(Name));
 }
 
+JITTargetAddress KaleidoscopeJIT::getSymbolAddress(const std::string &name) {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  auto symbol = findMangledSymbol(mangle(name));
+  if (!symbol) {
+    return 0;
+  }
+  return cantFail(symbol.getAddress());
+}
+
+void KaleidoscopeJIT::addHostSymbol(const std::string &name,
+                                    JITTargetAddress address) {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  hostSymbols[mangle(name)] = address;
+}
+
+void KaleidoscopeJIT::addStub(const std::string &name) {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  auto mangled = mangle(name);
+  if (!stubs->findStub(mangled, false)) {
+    cantFail(stubs->createStub(mangled, undefinedStubTarget(),
+                               JITSymbolFlags::Exported));
+    ++numStubs;
+  }
+}
+
+void KaleidoscopeJIT::redirectStub(const std::string &name, VModuleKey k) {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  auto mangled = mangle(name);
+  auto body = compileLayer.findSymbolIn(k, mangled, false);
+  if (!body) {
+    throw std::runtime_error("no definition of " + name + " to redirect to");
+  }
+  auto address = cantFail(body.getAddress());
+  addStub(name);
+  cantFail(stubs->updatePointer(mangled, address));
+}
+
+void KaleidoscopeJIT::clearStub(const std::string &name) {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  auto mangled = mangle(name);
+  if (stubs->findStub(mangled, false)) {
+    cantFail(stubs->updatePointer(mangled, undefinedStubTarget()));
+  }
+}
+
+KaleidoscopeJIT::SectionUsage
+KaleidoscopeJIT::getSectionUsage(VModuleKey k) {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  auto it = sectionUsage.find(k);
+  return it != sectionUsage.end() ? *it->second : SectionUsage{};
+}
+
+KaleidoscopeJIT::SectionUsage KaleidoscopeJIT::getSectionUsage() {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  SectionUsage total;
+  for (const auto &[k, usage] : sectionUsage) {
+    total.codeSections += usage->codeSections;
+    total.codeBytes += usage->codeBytes;
+    total.dataSections += usage->dataSections;
+    total.dataBytes += usage->dataBytes;
+  }
+  return total;
+}
+
+size_t KaleidoscopeJIT::getNumStubs() {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  return numStubs;
+}
+
+void KaleidoscopeJIT::enableGDBRegistration() {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  // The GDB listener is a process-wide singleton owned by LLVM.
+  eventListeners.push_back(JITEventListener::createGDBRegistrationListener());
+}
+
+void KaleidoscopeJIT::enablePerfMap() {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  ownedListeners.push_back(std::make_unique<PerfMapListener>());
+  eventListeners.push_back(ownedListeners.back().get());
+
+  // jitdump output is only available when LLVM was built with LLVM_USE_PERF.
+  if (auto *jitDump = JITEventListener::createPerfJITEventListener()) {
+    eventListeners.push_back(jitDump);
+  }
+}
+
+void KaleidoscopeJIT::addEventListener(JITEventListener &listener) {
+  std::lock_guard<std::recursive_mutex> lock(jitMutex);
+  eventListeners.push_back(&listener);
+}
+
+void KaleidoscopeJIT::notifyObjectLoaded(
+    VModuleKey k, const object::ObjectFile &obj,
+    const RuntimeDyld::LoadedObjectInfo &info) {
+  for (auto *listener : eventListeners) {
+    listener->notifyObjectLoaded(k, obj, info);
+  }
+}
+
+void KaleidoscopeJIT::notifyObjectFreed(VModuleKey k,
+                                        const object::ObjectFile &obj) {
+  for (auto *listener : eventListeners) {
+    listener->notifyFreeingObject(k);
+  }
+}
+
 std::string KaleidoscopeJIT::mangle(const std::string &Name) {
   std::string MangledName;
   {
@@ -49,6 +249,10 @@ std::string KaleidoscopeJIT::mangle(const std::string &Name) {
 }
 
 JITSymbol KaleidoscopeJIT::findMangledSymbol(const std::string &Name) {
+  // Redefinable functions are always reached through their stubs.
+  if (auto Stub = stubs->findStub(Name, false))
+    return Stub;
+
 #ifdef _WIN32
   // The symbol lookup of ObjectLinkingLayer uses the SymbolRef::SF_Exported
   // flag to decide whether a symbol will be visible or not, when we call
@@ -62,6 +266,10 @@ JITSymbol KaleidoscopeJIT::findMangledSymbol(const std::string &Name) {
   const bool ExportedSymbolsOnly = true;
 #endif
 
+  auto Host = hostSymbols.find(Name);
+  if (Host != hostSymbols.end())
+    return JITSymbol(Host->second, JITSymbolFlags::Exported);
+
   // Search modules in reverse order: from last added to first added.
   // This is the opposite of the usual search order for dlsym, but makes more
   // sense in a REPL where we want to bind to the newest available definition.
@@ -8,8 +8,12 @@ namespace lexer {
 Lexer::Lexer(std::istream &input) {
   tokens::Token token;
   do {
-    token = extractToken(input);
+    size_t offset = npos;
+    tokens::Location location;
+    token = extractToken(input, offset, location);
     tokens.push_back(token);
+    offsets.push_back(offset);
+    locations.push_back(location);
   } while (!std::holds_alternative<tokens::Eof>(token));
 }
 
@@ -26,23 +30,53 @@ tokens::Token Lexer::pop() {
     return tokens::Eof{};
   tokens::Token front = tokens.front();
   tokens.pop_front();
+  offsets.pop_front();
+  popped = locations.front();
+  locations.pop_front();
   return front;
 }
 
 bool Lexer::empty() const noexcept { return tokens.empty(); }
 
-tokens::Token Lexer::extractToken(std::istream &input) {
+size_t Lexer::offset() const {
+  return offsets.empty() ? npos : offsets.front();
+}
+
+tokens::Location Lexer::lastLocation() const noexcept { return popped; }
+
+// Reads one character, keeping track of the line and column it was on.
+bool Lexer::read(std::istream &input, char &c) {
+  if (!input.get(c)) {
+    return false;
+  }
+  if (c == '\n') {
+    ++line;
+    column = 0;
+  } else {
+    ++column;
+  }
+  return true;
+}
+
+tokens::Token Lexer::extractToken(std::istream &input, size_t &offset,
+                                  tokens::Location &location) {
   char next;
-  input >> std::skipws >> next;
+  do {
+    if (!read(input, next))
+      return tokens::Eof{};
+  } while (std::isspace(next));
 
-  if (!input)
-    return tokens::Eof{};
+  auto position = input.tellg();
+  if (position != std::istream::pos_type(-1)) {
+    offset = static_cast<size_t>(position) - 1;
+  }
+  location = {line, column};
 
   if (std::isalpha(next)) {
     std::string iden;
     iden += next;
-    while (input.peek() != WEOF && std::isalpha(input.peek())) {
-      input >> std::noskipws >> next;
+    while (input.peek() != WEOF && std::isalnum(input.peek())) {
+      read(input, next);
       iden += next;
     }
 
@@ -52,6 +86,21 @@ tokens::Token Lexer::extractToken(std::istream &input) {
     if (iden == "extern") {
       return tokens::Extern{};
     }
+    if (iden == "if") {
+      return tokens::If{};
+    }
+    if (iden == "then") {
+      return tokens::Then{};
+    }
+    if (iden == "else") {
+      return tokens::Else{};
+    }
+    if (iden == "for") {
+      return tokens::For{};
+    }
+    if (iden == "in") {
+      return tokens::In{};
+    }
     return tokens::Identifier{iden};
   }
 
@@ -61,7 +110,7 @@ tokens::Token Lexer::extractToken(std::istream &input) {
     numStr += next;
 
     while (input.peek() != WEOF && isDecimal(input.peek())) {
-      input >> std::noskipws >> next;
+      read(input, next);
       numStr += next;
     }
 
@@ -70,8 +119,10 @@ tokens::Token Lexer::extractToken(std::istream &input) {
   }
 
   if (next == '#') {
-    input.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
-    return extractToken(input);
+    while (read(input, next) && next != '\n') {
+    }
+    offset = npos;
+    return extractToken(input, offset, location);
   }
 
   return tokens::Character{next};
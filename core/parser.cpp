@@ -1,5 +1,7 @@
 #include "parser.hpp"
 
+#include <limits>
+
 template <class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
 template <class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 
@@ -24,22 +26,13 @@ std::unique_ptr<ast::AstNode> Parser::parse(lexer::Lexer &input) const {
 
 std::unique_ptr<ast::expr::ExprNode>
 Parser::parseExpression(lexer::Lexer &input) const {
-  auto token = input.pop();
-  auto lhs = parsePrimary(token, input);
-  if (!lhs) {
-    return nullptr;
-  }
-
-  if (getOpPrecedence(input.peek()) != -1) {
-    token = input.pop();
-    return parseBinOpRhs(0, std::move(lhs), token, input);
-  }
-  return lhs;
+  return parseOperation(input.pop(), input, false);
 }
 
 std::unique_ptr<ast::Prototype>
 Parser::parsePrototype(lexer::Lexer &input) const {
   auto next = input.pop();
+  tokens::Location location = input.lastLocation();
   std::string fnName;
   try {
     fnName = std::get<tokens::Identifier>(next).ident;
@@ -50,9 +43,11 @@ Parser::parsePrototype(lexer::Lexer &input) const {
   assertIsCharacter(input.pop(), '(', "prototype must open with '('");
 
   std::vector<std::string> argNames;
+  std::vector<ast::Type> argTypes;
   tokens::Token token;
   while (std::holds_alternative<tokens::Identifier>(token = input.pop())) {
     argNames.push_back(std::get<tokens::Identifier>(token).ident);
+    argTypes.push_back(parseTypeAnnotation(input));
     token = input.pop();
     wchar_t character;
     try {
@@ -73,24 +68,194 @@ Parser::parsePrototype(lexer::Lexer &input) const {
 
   assertIsCharacter(token, ')', "prototype must close with ')'");
 
-  return std::make_unique<ast::Prototype>(fnName, std::move(argNames));
+  ast::Type retType = parseTypeAnnotation(input);
+  auto proto = std::make_unique<ast::Prototype>(
+      fnName, std::move(argNames), false, std::move(argTypes), retType);
+  proto->location = location;
+  return proto;
+}
+
+ast::Type Parser::parseTypeAnnotation(lexer::Lexer &input) const {
+  if (!(input.peek() == tokens::Token{tokens::Character{':'}})) {
+    return ast::Type::F64;
+  }
+  input.pop();
+
+  auto token = input.pop();
+  std::string name;
+  try {
+    name = std::get<tokens::Identifier>(token).ident;
+  } catch (const std::bad_variant_access &) {
+    throw std::runtime_error("expected a type name after ':'");
+  }
+  if (input.peek() == tokens::Token{tokens::Character{'['}}) {
+    input.pop();
+    assertIsCharacter(input.pop(), ']', "expected ']' in buffer type");
+    name += "[]";
+  }
+  return ast::Type::fromName(name);
 }
 
 std::unique_ptr<ast::expr::ExprNode>
 Parser::parsePrimary(const tokens::Token &token, lexer::Lexer &input) const {
+  return parseOperation(token, input, true);
+}
+
+namespace {
+// A '(' or call whose ')' hasn't been read yet.
+struct Group {
+  // Unset for plain parentheses.
+  std::optional<std::string> callee;
+  std::vector<std::unique_ptr<ast::expr::ExprNode>> args;
+  // Operators below this belong to enclosing groups.
+  size_t operatorBase;
+  // Of the callee.
+  tokens::Location location;
+};
+
+std::unique_ptr<ast::expr::ExprNode>
+located(std::unique_ptr<ast::expr::ExprNode> node, tokens::Location location) {
+  std::visit([&](auto &expr) { expr.location = location; }, *node);
+  return node;
+}
+} // namespace
+
+// Parses operators, parentheses and call arguments with explicit stacks
+// (shunting-yard style), so neither long chains of operators nor deeply
+// nested parentheses and calls use more native stack. With primaryOnly it
+// stops after the first operand.
+std::unique_ptr<ast::expr::ExprNode>
+Parser::parseOperation(tokens::Token token, lexer::Lexer &input,
+                       bool primaryOnly) const {
+  const tokens::Token openParen{tokens::Character{'('}};
+  const tokens::Token closeParen{tokens::Character{')'}};
+  const tokens::Token comma{tokens::Character{','}};
+
+  std::vector<std::unique_ptr<ast::expr::ExprNode>> operands;
+  std::vector<char> operators;
+  std::vector<tokens::Location> operatorLocations;
+  std::vector<Group> groups;
+
+  // Folds the innermost group's pending operators that bind at least as
+  // tightly as minPrec into operands; all operators are left associative.
+  auto reduce = [&](int minPrec) {
+    size_t base = groups.empty() ? 0 : groups.back().operatorBase;
+    while (operators.size() > base &&
+           binOpPrecedence.at(operators.back()) >= minPrec) {
+      auto rhs = std::move(operands.back());
+      operands.pop_back();
+      auto lhs = std::move(operands.back());
+      operands.pop_back();
+      operands.push_back(located(
+          std::make_unique<ast::expr::ExprNode>(ast::expr::Binary(
+              operators.back(), std::move(lhs), std::move(rhs))),
+          operatorLocations.back()));
+      operators.pop_back();
+      operatorLocations.pop_back();
+    }
+  };
+  auto reduceGroup = [&] {
+    reduce(std::numeric_limits<int>::min());
+    auto value = std::move(operands.back());
+    operands.pop_back();
+    return value;
+  };
+
+  while (true) {
+    // Read an operand, opening any groups in front of it. Token is always
+    // the one popped last.
+    while (true) {
+      tokens::Location location = input.lastLocation();
+      if (token == openParen) {
+        groups.push_back({std::nullopt, {}, operators.size(), location});
+        token = input.pop();
+        continue;
+      }
+      auto *ident = std::get_if<tokens::Identifier>(&token);
+      if (ident && input.peek() == openParen) {
+        input.pop();
+        groups.push_back({ident->ident, {}, operators.size(), location});
+        if (input.peek() == closeParen) {
+          input.pop();
+          operands.push_back(
+              located(std::make_unique<ast::expr::ExprNode>(
+                          ast::expr::Call(*groups.back().callee, {})),
+                      location));
+          groups.pop_back();
+          break;
+        }
+        token = input.pop();
+        continue;
+      }
+      operands.push_back(located(parseOperand(token, input), location));
+      break;
+    }
+
+    // Then close groups until an operator or the end of the expression.
+    while (true) {
+      if (primaryOnly && groups.empty()) {
+        return std::move(operands.back());
+      }
+
+      auto next = input.peek();
+      int prec = getOpPrecedence(next);
+      if (prec != -1) {
+        input.pop();
+        reduce(prec);
+        operators.push_back(
+            static_cast<char>(std::get<tokens::Character>(next).character));
+        operatorLocations.push_back(input.lastLocation());
+        token = input.pop();
+        break;
+      }
+
+      if (groups.empty()) {
+        return reduceGroup();
+      }
+      auto &group = groups.back();
+      if (next == closeParen) {
+        input.pop();
+        auto value = reduceGroup();
+        if (group.callee) {
+          group.args.push_back(std::move(value));
+          value = located(std::make_unique<ast::expr::ExprNode>(ast::expr::Call(
+                              *group.callee, std::move(group.args))),
+                          group.location);
+        }
+        groups.pop_back();
+        operands.push_back(std::move(value));
+        continue;
+      }
+      if (group.callee && next == comma) {
+        input.pop();
+        group.args.push_back(reduceGroup());
+        token = input.pop();
+        break;
+      }
+
+      if (group.callee) {
+        throw std::runtime_error(
+            "call arguments must be split by , and ended with )");
+      }
+      throw std::runtime_error("unclosed parentheses!");
+    }
+  }
+}
+
+std::unique_ptr<ast::expr::ExprNode>
+Parser::parseOperand(const tokens::Token &token, lexer::Lexer &input) const {
   return std::visit(
       overloaded{
           [&](const tokens::Identifier &ident) {
             return parseIdentifier(ident, input);
           },
           [&](const tokens::Number &number) { return parseNumber(number); },
-          [&](const tokens::Character &character) {
-            if (character == '(') {
-              return parseParen(input);
-            } else {
-              throw std::runtime_error(
-                  "unable to parse unknown parentheses character");
-            }
+          [&](const tokens::If &) { return parseIf(input); },
+          [&](const tokens::For &) { return parseFor(input); },
+          [&](const tokens::Character &) {
+            throw std::runtime_error(
+                "unable to parse unknown parentheses character");
+            return std::unique_ptr<ast::expr::ExprNode>(nullptr);
           },
           [&](const auto &) {
             throw std::runtime_error(
@@ -111,59 +276,32 @@ Parser::parseTopLevelExpr(lexer::Lexer &input) const {
   return nullptr;
 }
 
-std::unique_ptr<ast::expr::ExprNode>
-Parser::parseParen(lexer::Lexer &input) const {
-  auto v = parseExpression(input);
-  if (!v)
-    return nullptr;
-
-  auto top = input.peek();
-  if (auto token = std::get_if<tokens::Character>(&top);
-      token && token->character != ')') {
-    throw std::runtime_error("unclosed parentheses!");
-  }
-  input.pop();
-  return v;
-}
-
 std::unique_ptr<ast::expr::ExprNode>
 Parser::parseIdentifier(const tokens::Identifier &ident,
                         lexer::Lexer &input) const {
   std::string idName = ident.ident;
 
-  if (!(input.peek() == tokens::Token{tokens::Character{L'('}})) {
-    return std::make_unique<ast::expr::ExprNode>(idName);
-  }
-  input.pop();
-
-  std::vector<std::unique_ptr<ast::expr::ExprNode>> args;
-  tokens::Token token;
-  while (true) {
-    if (!std::holds_alternative<tokens::Character>(input.peek())) {
-      args.push_back(std::move(parseExpression(input)));
-    }
-    token = input.pop();
-    wchar_t character;
-    try {
-      character = std::get<tokens::Character>(token).character;
-    } catch (const std::bad_variant_access &) {
-      throw std::runtime_error(
-          "call arguments must be split by , and ended with )");
-    }
-
-    if (character == ')') {
-      break;
+  if (input.peek() == tokens::Token{tokens::Character{'['}}) {
+    input.pop();
+    auto index = parseExpression(input);
+    if (!index) {
+      return nullptr;
     }
+    assertIsCharacter(input.pop(), ']', "index must close with ']'");
 
-    if (character != ',') {
-      throw std::runtime_error("call arguments must be split by ,");
+    std::unique_ptr<ast::expr::ExprNode> value;
+    if (input.peek() == tokens::Token{tokens::Character{'='}}) {
+      input.pop();
+      value = parseExpression(input);
+      if (!value) {
+        return nullptr;
+      }
     }
+    return std::make_unique<ast::expr::ExprNode>(
+        ast::expr::Index(idName, std::move(index), std::move(value)));
   }
 
-  assertIsCharacter(token, ')', "call must close with ')'");
-
-  return std::make_unique<ast::expr::ExprNode>(
-      ast::expr::Call(idName, std::move(args)));
+  return std::make_unique<ast::expr::ExprNode>(idName);
 }
 
 std::unique_ptr<ast::expr::ExprNode>
@@ -173,42 +311,78 @@ Parser::parseNumber(const tokens::Number &number) const {
 }
 
 std::unique_ptr<ast::expr::ExprNode>
-Parser::parseBinOpRhs(int exprPrec, std::unique_ptr<ast::expr::ExprNode> lhs,
-                      tokens::Token &op, lexer::Lexer &input) const {
-  while (true) {
-    int tokPrec = getOpPrecedence(op);
+Parser::parseIf(lexer::Lexer &input) const {
+  auto cond = parseExpression(input);
+  if (!cond) {
+    return nullptr;
+  }
 
-    if (tokPrec < exprPrec) {
-      return lhs;
-    }
+  if (!std::holds_alternative<tokens::Then>(input.pop())) {
+    throw std::runtime_error("expected then");
+  }
+  auto then = parseExpression(input);
+  if (!then) {
+    return nullptr;
+  }
 
-    wchar_t binOp;
-    try {
-      binOp = std::get<tokens::Character>(op).character;
-    } catch (const std::bad_variant_access &) {
-      throw std::runtime_error("binary operator must be a character!");
-    }
+  if (!std::holds_alternative<tokens::Else>(input.pop())) {
+    throw std::runtime_error("expected else");
+  }
+  auto otherwise = parseExpression(input);
+  if (!otherwise) {
+    return nullptr;
+  }
 
-    auto token = input.pop();
-    auto rhs = parsePrimary(token, input);
-    if (!rhs) {
-      return nullptr;
-    }
+  return std::make_unique<ast::expr::ExprNode>(
+      ast::expr::If(std::move(cond), std::move(then), std::move(otherwise)));
+}
 
-    op = input.peek();
-    int nextPrec = getOpPrecedence(op);
-    if (nextPrec != -1)
-      input.pop();
-    if (tokPrec < nextPrec) {
-      rhs = parseBinOpRhs(tokPrec + 1, std::move(rhs), op, input);
-      if (!rhs) {
-        return nullptr;
-      }
+std::unique_ptr<ast::expr::ExprNode>
+Parser::parseFor(lexer::Lexer &input) const {
+  auto token = input.pop();
+  std::string varName;
+  try {
+    varName = std::get<tokens::Identifier>(token).ident;
+  } catch (const std::bad_variant_access &) {
+    throw std::runtime_error("expected identifier after for");
+  }
+
+  std::optional<ast::Type> varType;
+  if (input.peek() == tokens::Token{tokens::Character{':'}}) {
+    varType = parseTypeAnnotation(input);
+  }
+
+  assertIsCharacter(input.pop(), '=', "expected '=' after for");
+  auto start = parseExpression(input);
+  if (!start) {
+    return nullptr;
+  }
+  assertIsCharacter(input.pop(), ',', "expected ',' after for start value");
+  auto cond = parseExpression(input);
+  if (!cond) {
+    return nullptr;
+  }
+
+  std::unique_ptr<ast::expr::ExprNode> step;
+  if (input.peek() == tokens::Token{tokens::Character{','}}) {
+    input.pop();
+    step = parseExpression(input);
+    if (!step) {
+      return nullptr;
     }
+  }
 
-    lhs = std::make_unique<ast::expr::ExprNode>(
-        ast::expr::Binary(binOp, std::move(lhs), std::move(rhs)));
+  if (!std::holds_alternative<tokens::In>(input.pop())) {
+    throw std::runtime_error("expected in after for");
   }
+  auto body = parseExpression(input);
+  if (!body) {
+    return nullptr;
+  }
+
+  return std::make_unique<ast::expr::ExprNode>(
+      ast::expr::For(varName, varType, std::move(start), std::move(cond),
+                     std::move(step), std::move(body)));
 }
 
 int Parser::getOpPrecedence(tokens::Token token) const {
@@ -232,9 +406,23 @@ std::unique_ptr<ast::AstNode> Parser::parseExtern(lexer::Lexer &input) const {
 
 std::unique_ptr<ast::AstNode>
 Parser::parseDefinition(lexer::Lexer &input) const {
+  // An optional floating point mode may precede the name: def fast f(x) ...
+  std::optional<ast::FPMode> fpMode;
+  auto first = input.peek();
+  auto *modeName = std::get_if<tokens::Identifier>(&first);
+  if (modeName && std::holds_alternative<tokens::Identifier>(input.peek(1))) {
+    fpMode = ast::fpModeFromName(modeName->ident);
+    if (!fpMode) {
+      throw std::runtime_error("unknown floating point mode " +
+                               modeName->ident);
+    }
+    input.pop();
+  }
+
   auto proto = parsePrototype(input);
   if (!proto)
     return nullptr;
+  proto->fpMode = fpMode;
 
   if (auto E = parseExpression(input))
     return std::make_unique<ast::AstNode>(
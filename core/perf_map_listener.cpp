@@ -0,0 +1,61 @@
+#include "perf_map_listener.hpp"
+
+#include "llvm/Object/SymbolSize.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+
+namespace llvm {
+namespace orc {
+
+PerfMapListener::PerfMapListener() {
+  std::string path =
+      "/tmp/perf-" + std::to_string(sys::Process::getProcessId()) + ".map";
+  std::error_code ec;
+  mapFile = std::make_unique<raw_fd_ostream>(path, ec, sys::fs::OF_Text);
+  if (ec) {
+    mapFile.reset();
+    errs() << "unable to open perf map " << path << ": " << ec.message()
+           << '\n';
+  }
+}
+
+void PerfMapListener::notifyObjectLoaded(
+    ObjectKey k, const object::ObjectFile &obj,
+    const RuntimeDyld::LoadedObjectInfo &info) {
+  if (!mapFile) {
+    return;
+  }
+
+  // The debug object has its sections relocated to their load addresses, so
+  // symbol addresses read from it are the ones perf will actually sample.
+  object::OwningBinary<object::ObjectFile> debugObj =
+      info.getObjectForDebug(obj);
+  if (!debugObj.getBinary()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mapMutex);
+  for (const auto &symSize :
+       object::computeSymbolSizes(*debugObj.getBinary())) {
+    const object::SymbolRef &sym = symSize.first;
+    auto type = sym.getType();
+    if (!type || *type != object::SymbolRef::ST_Function) {
+      consumeError(type.takeError());
+      continue;
+    }
+    auto name = sym.getName();
+    auto addr = sym.getAddress();
+    if (!name || !addr) {
+      consumeError(name.takeError());
+      consumeError(addr.takeError());
+      continue;
+    }
+    *mapFile << format_hex_no_prefix(*addr, 1) << ' '
+             << format_hex_no_prefix(symSize.second, 1) << ' ' << *name
+             << '\n';
+  }
+  mapFile->flush();
+}
+
+} // namespace orc
+} // namespace llvm
@@ -0,0 +1,465 @@
+#include "serialize.hpp"
+
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+#include "llvm/Support/MemoryBuffer.h"
+
+namespace {
+using ast::expr::ExprNode;
+
+// What is written for each node: its alternative of ExprNode.
+enum Tag : uint8_t {
+  NumberTag,
+  VariableTag,
+  BinaryTag,
+  CallTag,
+  IfTag,
+  ForTag,
+  IndexTag
+};
+static_assert(std::is_same_v<std::variant_alternative_t<IndexTag, ExprNode>,
+                             ast::expr::Index>,
+              "tags must follow the order of ExprNode");
+
+enum ForFlags : uint8_t { HasType = 1, HasStep = 2 };
+
+// Integers are LEB128 encoded, doubles stored as their 8 bytes (little
+// endian, like every host we run on).
+void writeVarint(std::string &out, uint64_t value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    out += static_cast<char>(value ? byte | 0x80 : byte);
+  } while (value);
+}
+
+class Writer {
+public:
+  void item(const ast::AstNode &item);
+  std::string finish() const;
+
+private:
+  void name(std::string &out, const std::string &name);
+  void type(std::string &out, ast::Type type);
+  void location(std::string &out, tokens::Location location);
+  void prototype(std::string &out, const ast::Prototype &proto);
+  void node(std::string &out, const ExprNode &node);
+  void expression(std::string &out, const ExprNode &root);
+
+  std::unordered_map<std::string, uint64_t> nameIndices;
+  std::vector<const std::string *> names;
+  std::string items;
+  uint64_t itemCount = 0;
+};
+
+void Writer::item(const ast::AstNode &item) {
+  items += static_cast<char>(item.index());
+  if (auto *proto = std::get_if<ast::Prototype>(&item)) {
+    prototype(items, *proto);
+  } else {
+    const auto &function = std::get<ast::Function>(item);
+    prototype(items, *function.proto);
+    expression(items, *function.body);
+  }
+  ++itemCount;
+}
+
+std::string Writer::finish() const {
+  std::string out(serialize::magic, sizeof(serialize::magic));
+  for (int shift = 0; shift < 32; shift += 8) {
+    out += static_cast<char>((serialize::version >> shift) & 0xff);
+  }
+  writeVarint(out, names.size());
+  for (const auto *name : names) {
+    writeVarint(out, name->size());
+    out += *name;
+  }
+  writeVarint(out, itemCount);
+  return out + items;
+}
+
+void Writer::name(std::string &out, const std::string &name) {
+  auto [it, added] = nameIndices.emplace(name, names.size());
+  if (added) {
+    names.push_back(&it->first);
+  }
+  writeVarint(out, it->second);
+}
+
+void Writer::type(std::string &out, ast::Type type) {
+  out += static_cast<char>(type.kind);
+  out += static_cast<char>(type.lanes);
+}
+
+void Writer::location(std::string &out, tokens::Location location) {
+  writeVarint(out, location.line);
+  writeVarint(out, location.column);
+}
+
+void Writer::prototype(std::string &out, const ast::Prototype &proto) {
+  name(out, proto.name);
+  out += static_cast<char>(proto.isExtern);
+  writeVarint(out, proto.args.size());
+  for (size_t i = 0; i < proto.args.size(); ++i) {
+    name(out, proto.args[i]);
+    type(out, proto.argTypes[i]);
+  }
+  type(out, proto.retType);
+  out += static_cast<char>(proto.fpMode ? 1 + static_cast<int>(*proto.fpMode)
+                                        : 0);
+  location(out, proto.location);
+}
+
+// Everything but the node's children.
+void Writer::node(std::string &out, const ExprNode &node) {
+  out += static_cast<char>(node.index());
+  std::visit([&](const auto &expr) { location(out, expr.location); }, node);
+  if (auto *num = std::get_if<ast::expr::Number>(&node)) {
+    char bytes[sizeof(num->val)];
+    std::memcpy(bytes, &num->val, sizeof(bytes));
+    out.append(bytes, sizeof(bytes));
+  } else if (auto *var = std::get_if<ast::expr::Variable>(&node)) {
+    name(out, var->name);
+  } else if (auto *bin = std::get_if<ast::expr::Binary>(&node)) {
+    out += bin->op;
+  } else if (auto *call = std::get_if<ast::expr::Call>(&node)) {
+    name(out, call->callee);
+    writeVarint(out, call->args.size());
+  } else if (auto *forExpr = std::get_if<ast::expr::For>(&node)) {
+    name(out, forExpr->varName);
+    out += static_cast<char>((forExpr->varType ? HasType : 0) |
+                             (forExpr->step ? HasStep : 0));
+    if (forExpr->varType) {
+      type(out, *forExpr->varType);
+    }
+  } else if (auto *index = std::get_if<ast::expr::Index>(&node)) {
+    name(out, index->buffer);
+    out += static_cast<char>(index->value ? 1 : 0);
+  }
+}
+
+// The node count, then the nodes in post-order, so that reading them back
+// only needs a stack of finished nodes.
+void Writer::expression(std::string &out, const ExprNode &root) {
+  std::string nodes;
+  uint64_t count = 0;
+  // Each node is pushed twice: to push its children, then to be written
+  // once they have been.
+  std::vector<std::pair<const ExprNode *, bool>> stack{{&root, false}};
+  while (!stack.empty()) {
+    auto [current, childrenDone] = stack.back();
+    stack.pop_back();
+    if (childrenDone) {
+      node(nodes, *current);
+      ++count;
+      continue;
+    }
+    stack.push_back({current, true});
+    std::vector<const ExprNode *> children;
+    if (auto *bin = std::get_if<ast::expr::Binary>(current)) {
+      children = {bin->lhs.get(), bin->rhs.get()};
+    } else if (auto *call = std::get_if<ast::expr::Call>(current)) {
+      for (const auto &arg : call->args) {
+        children.push_back(arg.get());
+      }
+    } else if (auto *ifExpr = std::get_if<ast::expr::If>(current)) {
+      children = {ifExpr->cond.get(), ifExpr->then.get(),
+                  ifExpr->otherwise.get()};
+    } else if (auto *forExpr = std::get_if<ast::expr::For>(current)) {
+      children = {forExpr->start.get(), forExpr->cond.get(),
+                  forExpr->step.get(), forExpr->body.get()};
+    } else if (auto *index = std::get_if<ast::expr::Index>(current)) {
+      children = {index->index.get(), index->value.get()};
+    }
+    for (auto it = children.rbegin(); it != children.rend(); ++it) {
+      if (*it) {
+        stack.push_back({*it, false});
+      }
+    }
+  }
+  writeVarint(out, count);
+  out += nodes;
+}
+
+class Reader {
+public:
+  explicit Reader(std::string_view data) : data(data) {}
+
+  std::vector<std::unique_ptr<ast::AstNode>> items();
+
+private:
+  [[noreturn]] void corrupt() const {
+    throw std::runtime_error("corrupt AST file");
+  }
+  uint8_t byte();
+  uint64_t varint();
+  // A count of things each taking at least one more byte.
+  size_t count();
+  const std::string &name();
+  ast::Type type();
+  tokens::Location location();
+  std::unique_ptr<ast::Prototype> prototype();
+  std::unique_ptr<ExprNode> expression();
+
+  std::string_view data;
+  size_t pos = 0;
+  std::vector<std::string> names;
+};
+
+std::vector<std::unique_ptr<ast::AstNode>> Reader::items() {
+  if (!serialize::isEncoded(data) ||
+      data.size() < sizeof(serialize::magic) + 4) {
+    throw std::runtime_error("not an AST file");
+  }
+  pos = sizeof(serialize::magic);
+  uint32_t fileVersion = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    fileVersion |= static_cast<uint32_t>(byte()) << shift;
+  }
+  if (fileVersion != serialize::version) {
+    throw std::runtime_error("AST file has format version " +
+                             std::to_string(fileVersion) + ", expected " +
+                             std::to_string(serialize::version));
+  }
+
+  names.resize(count());
+  for (auto &name : names) {
+    size_t size = varint();
+    if (size > data.size() - pos) {
+      corrupt();
+    }
+    name = data.substr(pos, size);
+    pos += size;
+  }
+
+  std::vector<std::unique_ptr<ast::AstNode>> result(count());
+  for (auto &item : result) {
+    uint8_t tag = byte();
+    auto proto = prototype();
+    if (tag == 0) {
+      item = std::make_unique<ast::AstNode>(std::move(*proto));
+    } else if (tag == 1) {
+      item = std::make_unique<ast::AstNode>(
+          ast::Function(std::move(proto), expression()));
+    } else {
+      corrupt();
+    }
+  }
+  if (pos != data.size()) {
+    corrupt();
+  }
+  return result;
+}
+
+uint8_t Reader::byte() {
+  if (pos >= data.size()) {
+    corrupt();
+  }
+  return static_cast<uint8_t>(data[pos++]);
+}
+
+uint64_t Reader::varint() {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t next = byte();
+    value |= static_cast<uint64_t>(next & 0x7f) << shift;
+    if (!(next & 0x80)) {
+      return value;
+    }
+  }
+  corrupt();
+}
+
+size_t Reader::count() {
+  uint64_t value = varint();
+  if (value > data.size() - pos) {
+    corrupt();
+  }
+  return static_cast<size_t>(value);
+}
+
+const std::string &Reader::name() {
+  uint64_t index = varint();
+  if (index >= names.size()) {
+    corrupt();
+  }
+  return names[index];
+}
+
+ast::Type Reader::type() {
+  uint8_t kind = byte();
+  uint8_t lanes = byte();
+  if (kind > ast::Type::F64Buffer ||
+      (lanes != 1 && (kind == ast::Type::F64Buffer ||
+                      !ast::Type::isLaneCount(lanes)))) {
+    corrupt();
+  }
+  return ast::Type(static_cast<ast::Type::Kind>(kind), lanes);
+}
+
+tokens::Location Reader::location() {
+  tokens::Location location;
+  location.line = static_cast<unsigned>(varint());
+  location.column = static_cast<unsigned>(varint());
+  return location;
+}
+
+std::unique_ptr<ast::Prototype> Reader::prototype() {
+  std::string protoName = name();
+  bool isExtern = byte() != 0;
+  std::vector<std::string> args(count());
+  std::vector<ast::Type> argTypes;
+  for (auto &arg : args) {
+    arg = name();
+    argTypes.push_back(type());
+  }
+  ast::Type retType = type();
+  auto proto = std::make_unique<ast::Prototype>(
+      protoName, std::move(args), isExtern, std::move(argTypes), retType);
+  uint8_t fpMode = byte();
+  if (fpMode > 1 + static_cast<int>(ast::FPMode::Fast)) {
+    corrupt();
+  }
+  if (fpMode) {
+    proto->fpMode = static_cast<ast::FPMode>(fpMode - 1);
+  }
+  proto->location = location();
+  return proto;
+}
+
+std::unique_ptr<ExprNode> Reader::expression() {
+  size_t numNodes = count();
+  std::vector<std::unique_ptr<ExprNode>> stack;
+  auto pop = [&] {
+    if (stack.empty()) {
+      corrupt();
+    }
+    auto node = std::move(stack.back());
+    stack.pop_back();
+    return node;
+  };
+
+  for (size_t i = 0; i < numNodes; ++i) {
+    uint8_t tag = byte();
+    tokens::Location nodeLocation = location();
+    std::unique_ptr<ExprNode> node;
+    switch (tag) {
+    case NumberTag: {
+      double val;
+      if (data.size() - pos < sizeof(val)) {
+        corrupt();
+      }
+      std::memcpy(&val, data.data() + pos, sizeof(val));
+      pos += sizeof(val);
+      node = std::make_unique<ExprNode>(ast::expr::Number(val));
+      break;
+    }
+    case VariableTag:
+      node = std::make_unique<ExprNode>(ast::expr::Variable(name()));
+      break;
+    case BinaryTag: {
+      char op = static_cast<char>(byte());
+      auto rhs = pop();
+      auto lhs = pop();
+      node = std::make_unique<ExprNode>(
+          ast::expr::Binary(op, std::move(lhs), std::move(rhs)));
+      break;
+    }
+    case CallTag: {
+      std::string callee = name();
+      uint64_t numArgs = varint();
+      if (numArgs > stack.size()) {
+        corrupt();
+      }
+      std::vector<std::unique_ptr<ExprNode>> args(
+          std::make_move_iterator(stack.end() - numArgs),
+          std::make_move_iterator(stack.end()));
+      stack.resize(stack.size() - numArgs);
+      node = std::make_unique<ExprNode>(
+          ast::expr::Call(callee, std::move(args)));
+      break;
+    }
+    case IfTag: {
+      auto otherwise = pop();
+      auto then = pop();
+      auto cond = pop();
+      node = std::make_unique<ExprNode>(ast::expr::If(
+          std::move(cond), std::move(then), std::move(otherwise)));
+      break;
+    }
+    case ForTag: {
+      std::string varName = name();
+      uint8_t flags = byte();
+      std::optional<ast::Type> varType;
+      if (flags & HasType) {
+        varType = type();
+      }
+      auto body = pop();
+      std::unique_ptr<ExprNode> step;
+      if (flags & HasStep) {
+        step = pop();
+      }
+      auto cond = pop();
+      auto start = pop();
+      node = std::make_unique<ExprNode>(
+          ast::expr::For(varName, varType, std::move(start), std::move(cond),
+                         std::move(step), std::move(body)));
+      break;
+    }
+    case IndexTag: {
+      std::string buffer = name();
+      bool hasValue = byte() != 0;
+      std::unique_ptr<ExprNode> value;
+      if (hasValue) {
+        value = pop();
+      }
+      auto index = pop();
+      node = std::make_unique<ExprNode>(
+          ast::expr::Index(buffer, std::move(index), std::move(value)));
+      break;
+    }
+    default:
+      corrupt();
+    }
+    std::visit([&](auto &expr) { expr.location = nodeLocation; }, *node);
+    stack.push_back(std::move(node));
+  }
+  if (stack.size() != 1) {
+    corrupt();
+  }
+  return std::move(stack.back());
+}
+} // namespace
+
+namespace serialize {
+std::string encode(const std::vector<std::unique_ptr<ast::AstNode>> &items) {
+  Writer writer;
+  for (const auto &item : items) {
+    writer.item(*item);
+  }
+  return writer.finish();
+}
+
+std::vector<std::unique_ptr<ast::AstNode>> decode(std::string_view data) {
+  return Reader(data).items();
+}
+
+bool isEncoded(std::string_view data) noexcept {
+  return data.substr(0, sizeof(magic)) ==
+         std::string_view(magic, sizeof(magic));
+}
+
+std::vector<std::unique_ptr<ast::AstNode>> load(const std::string &path) {
+  auto buffer = llvm::MemoryBuffer::getFile(path, -1, false);
+  if (!buffer) {
+    throw std::runtime_error("unable to open " + path + ": " +
+                             buffer.getError().message());
+  }
+  return decode(std::string_view((*buffer)->getBufferStart(),
+                                 (*buffer)->getBufferSize()));
+}
+} // namespace serialize
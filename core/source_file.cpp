@@ -0,0 +1,138 @@
+#include "source_file.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <unordered_set>
+
+namespace {
+// Equal exactly when the two items define the same thing the same way.
+std::string itemKey(const ast::AstNode &item) {
+  std::string key;
+  if (auto *function = std::get_if<ast::Function>(&item)) {
+    key = function->proto->name + '\0';
+    function->proto->fingerprint(key);
+    ast::expr::fingerprint(*function->body, key);
+  } else {
+    const auto &proto = std::get<ast::Prototype>(item);
+    key = proto.name + '\0';
+    proto.fingerprint(key);
+  }
+  return key;
+}
+} // namespace
+
+namespace source {
+std::vector<std::unique_ptr<ast::AstNode>> File::update(std::string newText) {
+  // What changed is what is left between the common prefix and suffix.
+  size_t prefix = std::mismatch(text.begin(), text.end(), newText.begin(),
+                                newText.end())
+                      .first -
+                  text.begin();
+  bool anyRejected =
+      std::any_of(items.begin(), items.end(),
+                  [](const Item &item) { return item.rejected; });
+  if (prefix == text.size() && prefix == newText.size() && !anyRejected) {
+    returned.clear();
+    return {};
+  }
+  size_t maxSuffix = std::min(text.size(), newText.size()) - prefix;
+  size_t suffix = 0;
+  while (suffix < maxSuffix && text[text.size() - suffix - 1] ==
+                                   newText[newText.size() - suffix - 1]) {
+    ++suffix;
+  }
+  size_t changedEnd = text.size() - suffix;
+
+  // Text inserted right where an item ends may continue it, so that item is
+  // parsed again too.
+  auto end = [&](size_t i) {
+    return i + 1 < items.size() ? items[i + 1].begin : text.size();
+  };
+  size_t first = 0;
+  while (first < items.size() && end(first) < prefix) {
+    ++first;
+  }
+  size_t last = first;
+  while (last < items.size() && items[last].begin <= changedEnd) {
+    ++last;
+  }
+  // Rejected items are returned again, so they are parsed again too.
+  for (size_t i = 0; i < items.size(); ++i) {
+    if (items[i].rejected) {
+      first = std::min(first, i);
+      last = std::max(last, i + 1);
+    }
+  }
+
+  try {
+    return reparse(newText, first, last);
+  } catch (const std::exception &) {
+    // The edit may have joined an item to the ones around it.
+    if (first == 0 && last == items.size()) {
+      throw;
+    }
+  }
+  return reparse(newText, 0, items.size());
+}
+
+void File::reject(size_t index) {
+  for (size_t i = index; i < returned.size(); ++i) {
+    items[returned[i]].rejected = true;
+  }
+}
+
+size_t File::size() const noexcept { return items.size(); }
+
+// Replaces items [first, last) with those parsed from the same stretch of
+// newText, which it takes over once they parse, returning the ones that differ
+// from all that were replaced (or were rejected).
+std::vector<std::unique_ptr<ast::AstNode>>
+File::reparse(std::string &newText, size_t first, size_t last) {
+  size_t begin = first == 0 ? 0 : items[first].begin;
+  size_t end = last < items.size() ? items[last].begin : text.size();
+  size_t newEnd = end + newText.size() - text.size();
+
+  std::istringstream input(newText.substr(begin, newEnd - begin));
+  lexer::Lexer lexer{input};
+  std::vector<Item> parsed;
+  std::vector<std::unique_ptr<ast::AstNode>> asts;
+  while (true) {
+    while (lexer.peek() == tokens::Token{tokens::Character{';'}}) {
+      lexer.pop();
+    }
+    if (std::holds_alternative<tokens::Eof>(lexer.peek())) {
+      break;
+    }
+    size_t offset = begin + lexer.offset();
+    asts.push_back(parser.parse(lexer));
+    parsed.push_back({offset, itemKey(*asts.back())});
+  }
+
+  std::unordered_multiset<std::string> replaced;
+  for (size_t i = first; i < last; ++i) {
+    if (!items[i].rejected) {
+      replaced.insert(std::move(items[i].key));
+    }
+  }
+  std::vector<std::unique_ptr<ast::AstNode>> changed;
+  returned.clear();
+  for (size_t i = 0; i < asts.size(); ++i) {
+    auto same = replaced.find(parsed[i].key);
+    if (same != replaced.end()) {
+      replaced.erase(same);
+    } else {
+      changed.push_back(std::move(asts[i]));
+      returned.push_back(first + i);
+    }
+  }
+
+  for (size_t i = last; i < items.size(); ++i) {
+    items[i].begin = items[i].begin + newText.size() - text.size();
+  }
+  items.erase(items.begin() + first, items.begin() + last);
+  items.insert(items.begin() + first, std::make_move_iterator(parsed.begin()),
+               std::make_move_iterator(parsed.end()));
+  text = std::move(newText);
+  return changed;
+}
+} // namespace source
@@ -22,6 +22,41 @@ std::ostream &operator<<(std::ostream &out, const Extern &c) {
   return out;
 }
 
+bool If::operator==(const If &other) const noexcept { return true; }
+
+std::ostream &operator<<(std::ostream &out, const If &c) {
+  out << "If";
+  return out;
+}
+
+bool Then::operator==(const Then &other) const noexcept { return true; }
+
+std::ostream &operator<<(std::ostream &out, const Then &c) {
+  out << "Then";
+  return out;
+}
+
+bool Else::operator==(const Else &other) const noexcept { return true; }
+
+std::ostream &operator<<(std::ostream &out, const Else &c) {
+  out << "Else";
+  return out;
+}
+
+bool For::operator==(const For &other) const noexcept { return true; }
+
+std::ostream &operator<<(std::ostream &out, const For &c) {
+  out << "For";
+  return out;
+}
+
+bool In::operator==(const In &other) const noexcept { return true; }
+
+std::ostream &operator<<(std::ostream &out, const In &c) {
+  out << "In";
+  return out;
+}
+
 Identifier::Identifier(const std::string &ident) : ident(ident) {}
 
 bool Identifier::operator==(const Identifier &other) const noexcept {
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <unordered_map>
 #include <variant>
 #include <vector>
@@ -20,7 +21,71 @@
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
 
+#include "tokens.hpp"
+
+namespace host {
+class Registry;
+} // namespace host
+
 namespace ast {
+// Value types a parameter or return can be annotated with. Anything without an
+// annotation is an f64, which keeps untyped code exactly as it was.
+//
+// An f64[] parameter is a caller-owned buffer of doubles. It is passed as two
+// native arguments, a noalias double* and an i64 length, and can only be
+// indexed, measured with len() or passed on to another buffer parameter.
+//
+// A scalar name followed by x2, x4, x8 or x16 (f64x4, f32x8, i64x2, ...) is a
+// SIMD vector of that many lanes. Operators work lane-wise and broadcast
+// scalar operands; vectors only become scalars through extract() or one of
+// the horizontal reductions.
+class Type {
+public:
+  enum Kind { Bool, I64, F32, F64, F64Buffer };
+
+  Type(Kind kind = F64, unsigned lanes = 1);
+
+  static Type fromName(const std::string &name);
+  static Type fromLLVM(llvm::Type *type);
+  static bool isLaneCount(unsigned lanes) noexcept;
+
+  llvm::Type *llvmType(llvm::LLVMContext &context) const;
+  // Both describe the lanes of a vector.
+  bool isFloat() const noexcept;
+  bool isBuffer() const noexcept;
+  bool isVector() const noexcept;
+  // The type of a single lane.
+  Type element() const noexcept;
+
+  bool operator==(const Type &other) const noexcept;
+  bool operator!=(const Type &other) const noexcept;
+
+  friend std::ostream &operator<<(std::ostream &out, const Type &type);
+
+  Kind kind;
+  // 1 for scalars.
+  unsigned lanes;
+};
+
+// Floating point semantics: strict IEEE, contraction of multiply-adds into
+// FMAs only, or full fast-math (reassociation, no NaNs/infs/signed zeros).
+enum class FPMode { Strict, Contract, Fast };
+
+std::optional<FPMode> fpModeFromName(const std::string &name);
+
+// Called by bounds-checked code on an out of range index (with the index and
+// the buffer's length); the host has to provide it.
+constexpr const char *boundsErrorSymbol = "__kaleidoscope_bounds_error";
+// Called by code dividing an integer by zero, or the smallest i64 by -1, with
+// both operands; the host has to provide it. It may return, and the division
+// then evaluates to 0 or the smallest i64.
+constexpr const char *divisionErrorSymbol = "__kaleidoscope_division_error";
+
+// Calls, conditionals, loops and indexing are generated recursively, a few
+// native frames per level, so nesting them deeper than this is refused
+// rather than overflowing the stack. Binary operators don't count.
+constexpr unsigned maxCodegenNesting = 2000;
+
 using named_values_t = std::unordered_map<std::string, llvm::Value *>;
 
 class Prototype;
@@ -29,12 +94,53 @@ using function_protos_t =
 
 class GenState {
 public:
-  llvm::LLVMContext context;
-  llvm::IRBuilder<> builder = llvm::IRBuilder<>(context);
+  // Starts over in a fresh context, freeing everything the old one uniqued
+  // (types, constants, names). Every module generated in the old context
+  // must have been destroyed; prototypes are context free, so later code
+  // can still call what was generated there.
+  void resetContext();
+
+  std::unique_ptr<llvm::LLVMContext> context =
+      std::make_unique<llvm::LLVMContext>();
+  std::unique_ptr<llvm::IRBuilder<>> builder =
+      std::make_unique<llvm::IRBuilder<>>(*context);
   std::unique_ptr<llvm::Module> llvmModule;
   named_values_t namedValues;
   function_protos_t functionProtos;
   std::unique_ptr<llvm::legacy::FunctionPassManager> optPasses = nullptr;
+  size_t anonExprCount = 0;
+  // Used by every function that doesn't pick its own mode.
+  FPMode fpMode = FPMode::Strict;
+  // Prepended to the symbol of everything defined here so several states can
+  // share one JIT without their names colliding.
+  std::string symbolPrefix;
+  // Check buffer indices against the buffer's length.
+  bool boundsChecks = false;
+  // Widest vectors, in bits, the vectorizer may use; 0 leaves it to the
+  // target, which may prefer narrower ones than the CPU has.
+  unsigned preferVectorWidth = 0;
+  // Give every function debug info (line tables only) with the locations of
+  // the AST, which is what optimization remarks point at.
+  bool debugLocations = false;
+  // Keep the frame pointer in every function, so that a profiler can walk
+  // the stacks of generated code.
+  bool framePointers = false;
+  // Functions callable without an extern, looked up after prototypes.
+  const host::Registry *hostFunctions = nullptr;
+  // Clones of functions with some parameters fixed, by specializationKey.
+  // Calls passing literals that match one call it instead, leaving those
+  // arguments out.
+  function_protos_t specializations;
+  // Calls, conditionals, loops and indexing being generated right now, one
+  // inside the other.
+  unsigned nesting = 0;
+};
+
+// Number of objects and (approximate) bytes of heap they occupy, for memory
+// accounting.
+struct Footprint {
+  size_t count = 0;
+  size_t bytes = 0;
 };
 
 namespace expr {
@@ -42,13 +148,20 @@ class Number;
 class Variable;
 class Binary;
 class Call;
+class If;
+class For;
+class Index;
 
-using ExprNode = std::variant<Number, Variable, Binary, Call>;
+using ExprNode = std::variant<Number, Variable, Binary, Call, If, For, Index>;
 
 class ExprInterface {
 public:
   virtual ~ExprInterface() {}
   virtual llvm::Value *codegen(GenState &state) = 0;
+
+  // Where the node was read from (for an operator, the operator itself).
+  // Not part of its fingerprint.
+  tokens::Location location;
 };
 
 class Number : public ExprInterface {
@@ -56,6 +169,8 @@ public:
   Number(double val);
 
   virtual llvm::Value *codegen(GenState &state) override;
+  // A literal takes on the type of the value it is combined with.
+  llvm::Value *codegenAs(GenState &state, Type type);
 
   friend std::ostream &operator<<(std::ostream &out, const Number &expr);
 
@@ -73,11 +188,18 @@ public:
   std::string name;
 };
 
+// Nodes with children free their subtrees without recursing, so dropping a
+// tree costs no native stack however deep it is.
 class Binary : public ExprInterface {
 public:
   Binary(char op, std::unique_ptr<ExprNode> lhs, std::unique_ptr<ExprNode> rhs);
+  Binary(Binary &&) = default;
+  Binary &operator=(Binary &&) = default;
+  ~Binary();
 
   virtual llvm::Value *codegen(GenState &state) override;
+  // Applies op to operands that have already been generated.
+  llvm::Value *emit(GenState &state, llvm::Value *L, llvm::Value *R);
 
   char op;
   std::unique_ptr<ExprNode> lhs;
@@ -89,6 +211,9 @@ public:
 class Call : public ExprInterface {
 public:
   Call(const std::string &callee, std::vector<std::unique_ptr<ExprNode>> args);
+  Call(Call &&) = default;
+  Call &operator=(Call &&) = default;
+  ~Call();
 
   virtual llvm::Value *codegen(GenState &state) override;
 
@@ -97,20 +222,114 @@ public:
 
   friend std::ostream &operator<<(std::ostream &out, const Call &call);
 };
+
+class If : public ExprInterface {
+public:
+  If(std::unique_ptr<ExprNode> cond, std::unique_ptr<ExprNode> then,
+     std::unique_ptr<ExprNode> otherwise);
+  If(If &&) = default;
+  If &operator=(If &&) = default;
+  ~If();
+
+  virtual llvm::Value *codegen(GenState &state) override;
+
+  std::unique_ptr<ExprNode> cond;
+  std::unique_ptr<ExprNode> then;
+  std::unique_ptr<ExprNode> otherwise;
+
+  friend std::ostream &operator<<(std::ostream &out, const If &expr);
+};
+
+// for var = start, cond[, step] in body: runs body while cond holds, adding
+// step (default 1) to var after each iteration. Always evaluates to 0.
+class For : public ExprInterface {
+public:
+  For(const std::string &varName, std::optional<Type> varType,
+      std::unique_ptr<ExprNode> start, std::unique_ptr<ExprNode> cond,
+      std::unique_ptr<ExprNode> step, std::unique_ptr<ExprNode> body);
+  For(For &&) = default;
+  For &operator=(For &&) = default;
+  ~For();
+
+  virtual llvm::Value *codegen(GenState &state) override;
+
+  std::string varName;
+  // Taken from start when not annotated.
+  std::optional<Type> varType;
+  std::unique_ptr<ExprNode> start;
+  std::unique_ptr<ExprNode> cond;
+  std::unique_ptr<ExprNode> step;
+  std::unique_ptr<ExprNode> body;
+
+  friend std::ostream &operator<<(std::ostream &out, const For &expr);
+};
+
+// buffer[index], or buffer[index] = value, which stores value and evaluates
+// to it.
+class Index : public ExprInterface {
+public:
+  Index(const std::string &buffer, std::unique_ptr<ExprNode> index,
+        std::unique_ptr<ExprNode> value = nullptr);
+  Index(Index &&) = default;
+  Index &operator=(Index &&) = default;
+  ~Index();
+
+  virtual llvm::Value *codegen(GenState &state) override;
+
+  std::string buffer;
+  std::unique_ptr<ExprNode> index;
+  std::unique_ptr<ExprNode> value;
+
+  friend std::ostream &operator<<(std::ostream &out, const Index &expr);
+};
+
+// Appends the name of every function called anywhere inside node.
+void collectCallees(const ExprNode &node, std::vector<std::string> &callees);
+// Appends every call anywhere inside node.
+void collectCalls(const ExprNode &node, std::vector<const Call *> &calls);
+// Adds node and everything below it, counting one per node.
+void measure(const ExprNode &node, Footprint &footprint);
+// Appends an encoding of node's structure to key: two trees give the same key
+// exactly when they would generate the same code given the same callees.
+void fingerprint(const ExprNode &node, std::string &key);
 } // namespace expr
 
 class Prototype {
 public:
   Prototype(const std::string &name, std::vector<std::string> args,
-            bool isExtern = false);
+            bool isExtern = false, std::vector<Type> argTypes = {},
+            Type retType = Type::F64);
 
   llvm::Function *codegen(GenState &state);
+  llvm::FunctionType *functionType(llvm::LLVMContext &context) const;
+  bool isUntyped() const noexcept;
+  // Externs keep their name so they still bind to the host (or another
+  // state's) definition.
+  std::string symbolName(const GenState &state) const;
+  void measure(Footprint &footprint) const;
+  // Like expr::fingerprint; the name is left out, so top-level expressions
+  // share a key with the same expression read again.
+  void fingerprint(std::string &key) const;
 
   std::string name;
   std::vector<std::string> args;
   bool isExtern;
+  std::vector<Type> argTypes;
+  Type retType;
+  std::optional<FPMode> fpMode;
+  // Of the name.
+  tokens::Location location;
 };
 
+// Implicitly converts value to type, as done for operands, arguments and
+// return values.
+llvm::Value *convert(GenState &state, llvm::Value *value, Type type);
+
+// Whether codegen handles calls to name itself, as long as no function of
+// that name exists: len(), the vector constructors such as f64x4(...), and
+// extract, insert, shuffle, hsum, hmin and hmax.
+bool isBuiltin(const std::string &name);
+
 class Function {
 public:
   Function(std::unique_ptr<Prototype> proto,
@@ -122,6 +341,21 @@ public:
   std::unique_ptr<expr::ExprNode> body;
 };
 
+// Constants one call passes a function: one entry per parameter, set where
+// the call passes a literal to a scalar parameter.
+using constants_t = std::vector<std::optional<double>>;
+
+constants_t constantArguments(const expr::Call &call, const Prototype &proto);
+std::string specializationKey(const std::string &callee,
+                              const constants_t &constants);
+// Generates a function called name that behaves like proto with body, but
+// with the parameters set in constants bound to them instead of passed, and
+// records it in state.specializations.
+llvm::Function *codegenSpecialization(GenState &state, const Prototype &proto,
+                                      expr::ExprNode &body,
+                                      const std::string &name,
+                                      const constants_t &constants);
+
 using AstNode = std::variant<Prototype, Function>;
 } // namespace ast
 
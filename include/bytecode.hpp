@@ -0,0 +1,101 @@
+#ifndef BYTECODE_BYTECODE_HPP_
+#define BYTECODE_BYTECODE_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.hpp"
+
+namespace bytecode {
+enum class Op : uint8_t {
+  LoadConst,
+  Move,
+  Add,
+  Sub,
+  Mul,
+  Div,
+  Lt,
+  Call,
+  Jump,
+  JumpIfFalse,
+  Ret
+};
+
+// Register machine instruction: dst = a <op> b. For Call, a is the callee
+// index and b the first of the callee's argument registers. Jumps go to
+// instruction b, JumpIfFalse when register a is zero.
+struct Instr {
+  Op op;
+  uint32_t dst;
+  uint32_t a;
+  uint32_t b;
+};
+
+struct Chunk {
+  size_t arity = 0;
+  uint32_t numRegs = 0;
+  std::vector<double> constants;
+  std::vector<Instr> code;
+};
+
+// A function known to native code: an extern or a JIT-compiled definition.
+// Only functions taking and returning doubles can be called from bytecode.
+struct NativeFunction {
+  void *address;
+  size_t arity;
+  bool untyped = true;
+};
+
+// Functions with more arguments than this can't be called from bytecode.
+constexpr size_t maxNativeArity = 6;
+
+class Interpreter {
+public:
+  using native_resolver_t =
+      std::function<std::optional<NativeFunction>(const std::string &)>;
+  using tier_up_t = std::function<void *(const std::string &)>;
+
+  Interpreter(native_resolver_t resolveNative, tier_up_t tierUp,
+              uint64_t tierUpThreshold);
+
+  // Both return false when the construct can't be interpreted, in which case
+  // the caller should compile it with the JIT instead.
+  bool define(const ast::Function &function);
+  std::optional<double> evaluate(const ast::expr::ExprNode &expr);
+
+  void setNative(const std::string &name, void *address);
+  bool isInterpreted(const std::string &name) const;
+  const std::vector<std::string> &callees(const std::string &name) const;
+
+private:
+  struct Entry {
+    std::string name;
+    size_t arity = 0;
+    bool defined = false;
+    void *native = nullptr;
+    bool tierUpFailed = false;
+    uint64_t calls = 0;
+    Chunk chunk;
+    std::vector<std::string> callees;
+  };
+
+  std::optional<uint32_t> lookup(const std::string &name);
+  double call(uint32_t index, size_t argBase);
+  double execute(const Chunk &chunk, size_t argBase);
+
+  native_resolver_t resolveNative;
+  tier_up_t tierUp;
+  uint64_t tierUpThreshold;
+  std::vector<Entry> functions;
+  std::unordered_map<std::string, uint32_t> functionIndices;
+  std::vector<double> stack;
+
+  friend class Compiler;
+};
+} // namespace bytecode
+
+#endif // !BYTECODE_BYTECODE_HPP_
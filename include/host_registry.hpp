@@ -0,0 +1,43 @@
+#ifndef HOST_HOST_REGISTRY_HPP_
+#define HOST_HOST_REGISTRY_HPP_
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.hpp"
+
+namespace host {
+// A function the embedding program makes callable from Kaleidoscope without
+// an extern and without any dynamic symbol lookup.
+struct Function {
+  std::string name;
+  void *address = nullptr;
+  std::vector<ast::Type> argTypes;
+  ast::Type retType = ast::Type::F64;
+  // The result depends on the arguments only and nothing is read or written
+  // (readnone), so calls can be hoisted, combined or dropped.
+  bool pure = false;
+  // Never unwinds (nounwind).
+  bool nothrow = false;
+  // Optional LLVM IR text defining the function under the same name. Calls
+  // are then inlined; address is only called where that is impossible.
+  std::string ir;
+
+  bool isUntyped() const noexcept;
+};
+
+// Populate before handing it to any session: lookups are not synchronized
+// with additions.
+class Registry {
+public:
+  void add(Function function);
+  const Function *find(const std::string &name) const;
+  const std::unordered_map<std::string, Function> &functions() const noexcept;
+
+private:
+  std::unordered_map<std::string, Function> entries;
+};
+} // namespace host
+
+#endif // !HOST_HOST_REGISTRY_HPP_
@@ -4,22 +4,29 @@
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/ADT/iterator_range.h"
 #include "llvm/ExecutionEngine/ExecutionEngine.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/LambdaResolver.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/ExecutionEngine/RTDyldMemoryManager.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Mangler.h"
 #include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Host.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace llvm {
@@ -30,23 +37,90 @@ public:
   using ObjLayerT = LegacyRTDyldObjectLinkingLayer;
   using CompileLayerT = LegacyIRCompileLayer<ObjLayerT, SimpleCompiler>;
 
-  KaleidoscopeJIT();
+  // What the linker allocated for loaded objects.
+  struct SectionUsage {
+    size_t codeSections = 0;
+    size_t codeBytes = 0;
+    size_t dataSections = 0;
+    size_t dataBytes = 0;
+  };
+
+  // Generates code for cpu with features (each "+name" or "-name") on top of
+  // what it implies. Without a cpu, that is the exact host CPU along with
+  // every feature it reports, so nothing the machine supports goes unused.
+  explicit KaleidoscopeJIT(const std::string &cpu = "",
+                           const std::vector<std::string> &features = {});
   TargetMachine &getTargetMachine();
+  // A target machine of its own for the same target. The JIT's is only safe
+  // to use under its lock, so threads compiling IR on their own use this.
+  std::unique_ptr<TargetMachine> createTargetMachine();
+  // Compiles m to an object right away and frees it, so nothing refers to
+  // its context once this returns.
   VModuleKey addModule(std::unique_ptr<Module> m);
+  // Writes the assembly the JIT would generate for m, without loading it.
+  void printAssembly(Module &m, raw_pwrite_stream &out);
   void removeModule(VModuleKey k);
   JITSymbol findSymbol(const std::string name);
+  // Looks name up and links it if necessary; 0 if it isn't defined. Unlike
+  // findSymbol this is safe to call while other threads use the JIT.
+  JITTargetAddress getSymbolAddress(const std::string &name);
+
+  // Binds name to a host address. These are found before anything in the
+  // process is searched with dlsym.
+  void addHostSymbol(const std::string &name, JITTargetAddress address);
+
+  // Once a name has a stub, every lookup of it returns the stub, so code
+  // linked afterwards calls through it and follows redirectStub. Until it is
+  // redirected, a new stub leads to a fatal "no definition" error.
+  void addStub(const std::string &name);
+  // Atomically points the stub for name at module k's definition of it.
+  void redirectStub(const std::string &name, VModuleKey k);
+  // Points the stub for name back at the "no definition" error, so the
+  // module defining it can be removed.
+  void clearStub(const std::string &name);
+
+  // Sections are only allocated once a module is linked, so this is empty
+  // for modules nothing has been looked up in yet.
+  SectionUsage getSectionUsage(VModuleKey k);
+  // Totals over every loaded module.
+  SectionUsage getSectionUsage();
+  size_t getNumStubs();
+
+  // Opt-in registration of emitted objects with external tools. Only objects
+  // added after the call are registered.
+  void enableGDBRegistration();
+  void enablePerfMap();
+  // Also notifies listener, which must outlive the JIT, of objects loaded
+  // and freed from now on.
+  void addEventListener(JITEventListener &listener);
 
 private:
   std::string mangle(const std::string &name);
   JITSymbol findMangledSymbol(const std::string &name);
+  void notifyObjectLoaded(VModuleKey k, const object::ObjectFile &obj,
+                          const RuntimeDyld::LoadedObjectInfo &info);
+  void notifyObjectFreed(VModuleKey k, const object::ObjectFile &obj);
 
+  // All layers are single threaded, so every entry point holds this. It is
+  // recursive because linking calls back into symbol resolution.
+  std::recursive_mutex jitMutex;
   ExecutionSession es;
   std::shared_ptr<SymbolResolver> resolver;
+  const std::string targetCpu;
+  const std::vector<std::string> targetFeatures;
   std::unique_ptr<TargetMachine> tm;
   const DataLayout dl;
   ObjLayerT objectLayer;
   CompileLayerT compileLayer;
+  std::unique_ptr<IndirectStubsManager> stubs;
+  size_t numStubs = 0;
+  std::unordered_map<std::string, JITTargetAddress> hostSymbols;
+  // Shared with each module's memory manager, which outlives its entry here
+  // until the object is freed.
+  std::map<VModuleKey, std::shared_ptr<SectionUsage>> sectionUsage;
   std::vector<VModuleKey> moduleKeys;
+  std::vector<JITEventListener *> eventListeners;
+  std::vector<std::unique_ptr<JITEventListener>> ownedListeners;
 };
 
 } // end namespace orc
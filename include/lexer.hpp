@@ -16,11 +16,26 @@ public:
   tokens::Token peek(size_t forward = 0ull) const;
   tokens::Token pop();
   bool empty() const noexcept;
+  // Where in the input the next token starts, or npos at the end (or if the
+  // input can't tell).
+  size_t offset() const;
+  // Where the token pop last returned starts.
+  tokens::Location lastLocation() const noexcept;
+
+  static constexpr size_t npos = static_cast<size_t>(-1);
 
 private:
   std::list<tokens::Token> tokens;
+  std::list<size_t> offsets;
+  std::list<tokens::Location> locations;
+  tokens::Location popped;
+  // Of the character read last.
+  unsigned line = 1;
+  unsigned column = 0;
 
-  tokens::Token extractToken(std::istream &input);
+  tokens::Token extractToken(std::istream &input, size_t &offset,
+                             tokens::Location &location);
+  bool read(std::istream &input, char &c);
 };
 } // namespace lexer
 
@@ -17,19 +17,23 @@ public:
   std::unique_ptr<ast::expr::ExprNode>
   parseExpression(lexer::Lexer &input) const;
   std::unique_ptr<ast::Prototype> parsePrototype(lexer::Lexer &input) const;
+  ast::Type parseTypeAnnotation(lexer::Lexer &input) const;
   std::unique_ptr<ast::expr::ExprNode> parsePrimary(const tokens::Token &token,
                                                     lexer::Lexer &input) const;
 
 private:
   std::unique_ptr<ast::AstNode> parseTopLevelExpr(lexer::Lexer &input) const;
-  std::unique_ptr<ast::expr::ExprNode> parseParen(lexer::Lexer &input) const;
+  std::unique_ptr<ast::expr::ExprNode>
+  parseOperation(tokens::Token token, lexer::Lexer &input,
+                 bool primaryOnly) const;
+  std::unique_ptr<ast::expr::ExprNode>
+  parseOperand(const tokens::Token &token, lexer::Lexer &input) const;
   std::unique_ptr<ast::expr::ExprNode>
   parseIdentifier(const tokens::Identifier &ident, lexer::Lexer &input) const;
   std::unique_ptr<ast::expr::ExprNode>
   parseNumber(const tokens::Number &number) const;
-  std::unique_ptr<ast::expr::ExprNode>
-  parseBinOpRhs(int exprPrec, std::unique_ptr<ast::expr::ExprNode> lhs,
-                tokens::Token &op, lexer::Lexer &input) const;
+  std::unique_ptr<ast::expr::ExprNode> parseIf(lexer::Lexer &input) const;
+  std::unique_ptr<ast::expr::ExprNode> parseFor(lexer::Lexer &input) const;
   int getOpPrecedence(tokens::Token token) const;
   std::unique_ptr<ast::AstNode> parseExtern(lexer::Lexer &input) const;
   std::unique_ptr<ast::AstNode> parseDefinition(lexer::Lexer &input) const;
@@ -0,0 +1,30 @@
+#ifndef PERF_MAP_LISTENER_HPP_
+#define PERF_MAP_LISTENER_HPP_
+
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <mutex>
+
+namespace llvm {
+namespace orc {
+
+// Writes every function symbol of a loaded object to /tmp/perf-<pid>.map so
+// `perf report` can resolve samples that land in JIT-compiled code.
+class PerfMapListener : public JITEventListener {
+public:
+  PerfMapListener();
+
+  void notifyObjectLoaded(ObjectKey k, const object::ObjectFile &obj,
+                          const RuntimeDyld::LoadedObjectInfo &info) override;
+
+private:
+  std::mutex mapMutex;
+  std::unique_ptr<raw_fd_ostream> mapFile;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif // !PERF_MAP_LISTENER_HPP_
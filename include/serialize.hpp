@@ -0,0 +1,33 @@
+#ifndef SERIALIZE_SERIALIZE_HPP_
+#define SERIALIZE_SERIALIZE_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "ast.hpp"
+
+namespace serialize {
+// A binary encoding of parsed top-level items, so that they can be loaded
+// again without lexing and parsing their source. It starts with magic and
+// the format version, followed by a table of every name used and the items,
+// whose expressions are stored children first. Decoding never recurses, so
+// expressions of any depth round trip.
+constexpr char magic[4] = {'K', 'A', 'S', 'T'};
+// Bumped on every change to the format; files of other versions are rejected.
+constexpr uint32_t version = 1;
+
+std::string encode(const std::vector<std::unique_ptr<ast::AstNode>> &items);
+// Throws on anything encode didn't produce.
+std::vector<std::unique_ptr<ast::AstNode>> decode(std::string_view data);
+
+// Whether data starts like encoded items do.
+bool isEncoded(std::string_view data) noexcept;
+// Decodes the file at path, which is memory-mapped if it is large enough
+// for that to pay off.
+std::vector<std::unique_ptr<ast::AstNode>> load(const std::string &path);
+} // namespace serialize
+
+#endif // !SERIALIZE_SERIALIZE_HPP_
@@ -0,0 +1,47 @@
+#ifndef SOURCE_SOURCE_FILE_HPP_
+#define SOURCE_SOURCE_FILE_HPP_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ast.hpp"
+#include "parser.hpp"
+
+namespace source {
+// A source file remembered as its top-level items, so that after an edit
+// only the items around the changed text are lexed and parsed again.
+class File {
+public:
+  // Takes the file's new contents and returns, in order, the items added or
+  // changed since the last update (all of them the first time). Items that
+  // were only reformatted or moved are left out. A parse error leaves the
+  // file as it was.
+  std::vector<std::unique_ptr<ast::AstNode>> update(std::string newText);
+  // Marks the items the last update returned, from the index-th on, as not
+  // run (say one failed to compile), so that the next update returns them
+  // again whether they changed or not.
+  void reject(size_t index);
+
+  size_t size() const noexcept;
+
+private:
+  // An item runs from its first token to the next item's first token.
+  struct Item {
+    size_t begin;
+    std::string key;
+    bool rejected = false;
+  };
+
+  std::vector<std::unique_ptr<ast::AstNode>>
+  reparse(std::string &newText, size_t first, size_t last);
+
+  parser::Parser parser;
+  std::string text;
+  std::vector<Item> items;
+  // Indices in items of what the last update returned.
+  std::vector<size_t> returned;
+};
+} // namespace source
+
+#endif // !SOURCE_SOURCE_FILE_HPP_
@@ -26,6 +26,41 @@ public:
   friend std::ostream &operator<<(std::ostream &out, const Extern &c);
 };
 
+class If {
+public:
+  bool operator==(const If &other) const noexcept;
+
+  friend std::ostream &operator<<(std::ostream &out, const If &c);
+};
+
+class Then {
+public:
+  bool operator==(const Then &other) const noexcept;
+
+  friend std::ostream &operator<<(std::ostream &out, const Then &c);
+};
+
+class Else {
+public:
+  bool operator==(const Else &other) const noexcept;
+
+  friend std::ostream &operator<<(std::ostream &out, const Else &c);
+};
+
+class For {
+public:
+  bool operator==(const For &other) const noexcept;
+
+  friend std::ostream &operator<<(std::ostream &out, const For &c);
+};
+
+class In {
+public:
+  bool operator==(const In &other) const noexcept;
+
+  friend std::ostream &operator<<(std::ostream &out, const In &c);
+};
+
 class Identifier {
 public:
   Identifier(const std::string &ident);
@@ -62,7 +97,14 @@ public:
   char character;
 };
 
-using Token = std::variant<Def, Extern, Identifier, Number, Character, Eof>;
+using Token = std::variant<Def, Extern, If, Then, Else, For, In, Identifier,
+                           Number, Character, Eof>;
+
+// Where a token starts: 1-based line and column, or line 0 when unknown.
+struct Location {
+  unsigned line = 0;
+  unsigned column = 0;
+};
 } // namespace tokens
 
 #endif // !TOKENS_TOKENS_HPP_
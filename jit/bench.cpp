@@ -0,0 +1,116 @@
+#include "bench.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC 1
+#endif
+
+namespace {
+using clock = std::chrono::steady_clock;
+
+constexpr std::chrono::milliseconds warmupTime{50};
+constexpr std::chrono::seconds defaultTime{1};
+// Shorter samples would mostly measure reading the clock.
+constexpr std::chrono::microseconds minSampleTime{10};
+
+uint64_t readCycles() {
+#ifdef BENCH_HAS_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+double percentile(const std::vector<double> &sorted, double p) {
+  return sorted[static_cast<size_t>(p * (sorted.size() - 1) + 0.5)];
+}
+} // namespace
+
+namespace bench {
+Result run(double (*fn)(), size_t iterations) {
+  // Also tells roughly what a call costs.
+  size_t warmupCalls = 0;
+  auto start = clock::now();
+  clock::duration elapsed;
+  do {
+    fn();
+    ++warmupCalls;
+    elapsed = clock::now() - start;
+  } while (elapsed < warmupTime);
+  auto perCall = std::max(elapsed / static_cast<clock::rep>(warmupCalls),
+                          clock::duration(1));
+
+  if (!iterations) {
+    iterations = std::max<size_t>(1, defaultTime / perCall);
+  }
+  size_t batch = std::clamp<size_t>(minSampleTime / perCall, 1, iterations);
+
+  Result result;
+  result.samples = iterations / batch;
+  result.calls = result.samples * batch;
+  std::vector<double> samples;
+  samples.reserve(result.samples);
+  uint64_t cycles = 0;
+  for (size_t i = 0; i < result.samples; ++i) {
+    uint64_t startCycles = readCycles();
+    auto sampleStart = clock::now();
+    for (size_t j = 0; j < batch; ++j) {
+      fn();
+    }
+    auto sampleTime = clock::now() - sampleStart;
+    cycles += readCycles() - startCycles;
+    samples.push_back(
+        std::chrono::duration<double, std::nano>(sampleTime).count() / batch);
+  }
+
+  for (double sample : samples) {
+    result.mean += sample;
+  }
+  result.mean /= samples.size();
+  std::sort(samples.begin(), samples.end());
+  result.min = samples.front();
+  result.p50 = percentile(samples, 0.5);
+  result.p90 = percentile(samples, 0.9);
+  result.p99 = percentile(samples, 0.99);
+  result.max = samples.back();
+#ifdef BENCH_HAS_TSC
+  result.cycles = static_cast<double>(cycles) / result.calls;
+#endif
+  return result;
+}
+
+void print(std::ostream &out, const Result &result) {
+  std::ostringstream text;
+  text << std::fixed << std::setprecision(2);
+  text << result.calls << " calls in " << result.samples << " samples\n"
+       << "ns/call: mean " << result.mean << "  min " << result.min
+       << "  p50 " << result.p50 << "  p90 " << result.p90 << "  p99 "
+       << result.p99 << "  max " << result.max << '\n';
+  if (result.cycles) {
+    text << "cycles/call: " << *result.cycles << '\n';
+  }
+  out << text.str();
+}
+
+std::string format(std::chrono::nanoseconds duration) {
+  double value = duration.count();
+  const char *unit = "ns";
+  for (const char *larger : {"us", "ms", "s"}) {
+    if (value < 1000) {
+      break;
+    }
+    value /= 1000;
+    unit = larger;
+  }
+  std::ostringstream text;
+  text << std::fixed << std::setprecision(value < 10 ? 2 : 1) << value << ' '
+       << unit;
+  return text.str();
+}
+} // namespace bench
@@ -0,0 +1,36 @@
+#ifndef JIT_BENCH_HPP_
+#define JIT_BENCH_HPP_
+
+#include <chrono>
+#include <iostream>
+#include <optional>
+#include <string>
+
+namespace bench {
+// Nanoseconds per call over samples of one or more calls each, so that even
+// a call far shorter than a clock read is measured accurately.
+struct Result {
+  size_t calls = 0;
+  size_t samples = 0;
+  double mean = 0;
+  double min = 0;
+  double p50 = 0;
+  double p90 = 0;
+  double p99 = 0;
+  double max = 0;
+  // Time stamp counter ticks per call, on CPUs that have one.
+  std::optional<double> cycles;
+};
+
+// Calls fn about iterations times after warming it up; 0 calls it for about
+// a second.
+Result run(double (*fn)(), size_t iterations);
+// The most calls run is asked to make.
+constexpr size_t maxIterations = 1000000000;
+void print(std::ostream &out, const Result &result);
+
+// Formats duration in the largest unit it is at least one of.
+std::string format(std::chrono::nanoseconds duration);
+} // namespace bench
+
+#endif // !JIT_BENCH_HPP_
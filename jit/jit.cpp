@@ -1,84 +1,463 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
 
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/TargetSelect.h"
-#include "llvm/Target/TargetMachine.h"
-#include "llvm/Transforms/InstCombine/InstCombine.h"
-#include "llvm/Transforms/Scalar.h"
-#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
 
+#include "host_registry.hpp"
 #include "kaleidoscope_jit.hpp"
 #include "parser.hpp"
+#include "profiler.hpp"
+#include "remarks.hpp"
+#include "serialize.hpp"
+#include "server.hpp"
+#include "session.hpp"
+#include "watch.hpp"
 
-using jit_ptr_t = llvm::orc::KaleidoscopeJIT;
-
-namespace legacy = llvm::legacy;
-
-void makeModule(ast::GenState &state, jit_ptr_t &jit) {
-  state.llvmModule =
-      std::make_unique<llvm::Module>("KaleidoscopeJIT", state.context);
-  state.llvmModule->setDataLayout(jit.getTargetMachine().createDataLayout());
-  state.optPasses =
-      std::make_unique<legacy::FunctionPassManager>(state.llvmModule.get());
-  state.optPasses->add(llvm::createInstructionCombiningPass());
-  state.optPasses->add(llvm::createReassociatePass());
-  state.optPasses->add(llvm::createGVNPass());
-  state.optPasses->add(llvm::createCFGSimplificationPass());
-  state.optPasses->doInitialization();
+namespace cl = llvm::cl;
+
+static cl::OptionCategory kjitCategory("kjit options");
+
+static cl::opt<bool>
+    gdbRegistration("gdb",
+                    cl::desc("Register JIT-compiled code with the GDB JIT "
+                             "interface"),
+                    cl::cat(kjitCategory));
+
+static cl::opt<bool>
+    perfMap("perf",
+            cl::desc("Write /tmp/perf-<pid>.map (and jitdump if LLVM supports "
+                     "it) for JIT-compiled code"),
+            cl::cat(kjitCategory));
+
+static cl::opt<bool>
+    parallel("parallel",
+             cl::desc("Compile every top-level expression of an input, then "
+                      "evaluate them concurrently and print results in "
+                      "source order"),
+             cl::cat(kjitCategory));
+
+static cl::opt<unsigned>
+    parallelJobs("j",
+                 cl::desc("Worker threads for --parallel (default: all "
+                          "cores)"),
+                 cl::value_desc("threads"), cl::init(0),
+                 cl::cat(kjitCategory));
+
+static cl::opt<bool>
+    tiered("tiered",
+           cl::desc("Interpret top-level expressions and cold functions as "
+                    "bytecode, JIT-compiling functions once they get hot"),
+           cl::cat(kjitCategory));
+
+static cl::opt<unsigned>
+    tierUpThreshold("tier-up-threshold",
+                    cl::desc("Calls before an interpreted function is "
+                             "JIT-compiled"),
+                    cl::init(1000), cl::cat(kjitCategory));
+
+static cl::opt<ast::FPMode> fpMode(
+    "fp-mode",
+    cl::desc("Floating point semantics for functions without their own mode"),
+    cl::values(clEnumValN(ast::FPMode::Strict, "strict", "Strict IEEE"),
+               clEnumValN(ast::FPMode::Contract, "contract",
+                          "Allow contracting multiply-adds into FMAs"),
+               clEnumValN(ast::FPMode::Fast, "fast", "Full fast-math")),
+    cl::init(ast::FPMode::Strict), cl::cat(kjitCategory));
+
+static cl::opt<std::string>
+    targetCPU("mcpu",
+              cl::desc("CPU to generate code for (default: the host's)"),
+              cl::value_desc("cpu"), cl::cat(kjitCategory));
+
+static cl::list<std::string>
+    targetFeatures("mattr", cl::CommaSeparated,
+                   cl::desc("Target features to enable (+name) or disable "
+                            "(-name) on top of the CPU's"),
+                   cl::value_desc("features"), cl::cat(kjitCategory));
+
+static cl::opt<unsigned> preferVectorWidth(
+    "prefer-vector-width",
+    cl::desc("Widest vectors in bits the vectorizer may use, e.g. 512 to use "
+             "AVX-512 registers (default: the target's preference)"),
+    cl::value_desc("bits"), cl::init(0), cl::cat(kjitCategory));
+
+static cl::opt<bool>
+    boundsChecks("bounds-checks",
+                 cl::desc("Abort on out of range buffer indices instead of "
+                          "leaving them undefined"),
+                 cl::cat(kjitCategory));
+
+static cl::opt<bool>
+    printIR("print-ir",
+            cl::desc("Print the optimized IR of every function and "
+                     "expression compiled (:ir prints one on demand)"),
+            cl::cat(kjitCategory));
+
+static cl::opt<std::string>
+    remarksFile("remarks",
+                cl::desc("Write the optimization remarks (passed, missed and "
+                         "analysis) of everything compiled to this file as "
+                         "YAML (:remarks shows one function's)"),
+                cl::value_desc("file"), cl::cat(kjitCategory));
+
+static cl::opt<bool>
+    profile("profile",
+            cl::desc("Sample where JIT-compiled code spends its time "
+                     "(:profile prints the hottest functions)"),
+            cl::cat(kjitCategory));
+
+static cl::opt<std::string> profileOutput(
+    "profile-output",
+    cl::desc("Profile, and write the sampled stacks to this file on exit in "
+             "the folded format flamegraph.pl and pprof read"),
+    cl::value_desc("file"), cl::cat(kjitCategory));
+
+static cl::opt<unsigned>
+    exprCacheSize("expr-cache",
+                  cl::desc("Compiled top-level expressions kept for "
+                           "re-evaluation (0 disables the cache)"),
+                  cl::value_desc("entries"), cl::init(256),
+                  cl::cat(kjitCategory));
+
+static cl::opt<unsigned>
+    evictAfter("evict-after",
+               cl::desc("Unload functions nothing has used for this many "
+                        "seconds, recompiling them when next called (0 "
+                        "never unloads)"),
+               cl::value_desc("seconds"), cl::init(0), cl::cat(kjitCategory));
+
+static cl::opt<unsigned> recycleContextModules(
+    "recycle-context",
+    cl::desc("Generate code in a fresh LLVMContext after this many modules, "
+             "freeing what the old one uniqued (0 never does)"),
+    cl::value_desc("modules"), cl::init(1000), cl::cat(kjitCategory));
+
+static cl::opt<unsigned> recycleContextMB(
+    "recycle-context-mb",
+    cl::desc("Also switch to a fresh LLVMContext once what the current one "
+             "uniqued comes to this much (0 never does)"),
+    cl::value_desc("MiB"), cl::init(0), cl::cat(kjitCategory));
+
+static cl::opt<unsigned> specializationBudget(
+    "specialize",
+    cl::desc("IR instructions to spend on copies of functions specialized on "
+             "the constant arguments they are called with (0 disables)"),
+    cl::value_desc("instructions"), cl::init(4096), cl::cat(kjitCategory));
+
+static cl::opt<std::string>
+    serveSocket("serve",
+                cl::desc("Serve sessions on a Unix domain socket instead of "
+                         "running a REPL"),
+                cl::value_desc("socket path"), cl::cat(kjitCategory));
+
+static cl::opt<unsigned>
+    maxClients("max-clients",
+               cl::desc("Connections --serve handles at once; more wait to "
+                        "be accepted until one closes"),
+               cl::value_desc("connections"), cl::init(64),
+               cl::cat(kjitCategory));
+
+static cl::opt<std::string>
+    libraryFile("library",
+                cl::desc("Source file compiled once and shared by every "
+                         "--serve session"),
+                cl::value_desc("file"), cl::cat(kjitCategory));
+
+static cl::opt<bool>
+    watchFiles("watch",
+               cl::desc("Keep watching the input files, running again the "
+                        "items that change whenever one is saved"),
+               cl::cat(kjitCategory));
+
+static cl::opt<std::string>
+    emitAST("emit-ast",
+            cl::desc("Parse the input files and write their items to this "
+                     "file in binary form, which kjit loads without lexing "
+                     "or parsing when given it as an input"),
+            cl::value_desc("file"), cl::cat(kjitCategory));
+
+static cl::list<std::string> inputFiles(cl::Positional,
+                                        cl::desc("[source files]"),
+                                        cl::cat(kjitCategory));
+
+// Runtime support for --bounds-checks.
+void boundsError(int64_t index, int64_t length) {
+  std::cerr << "buffer index " << index << " out of bounds for length "
+            << length << '\n';
+  std::abort();
 }
 
-void parseAndExecuteTokenStream(lexer::Lexer &lexer,
-                                const parser::Parser &parser,
-                                llvm::orc::KaleidoscopeJIT &jit,
-                                ast::GenState &state) {
-  while (!std::holds_alternative<tokens::Eof>(lexer.peek())) {
-    auto ast = parser.parse(lexer);
+// Reports integer division by zero or overflowing, which then goes on.
+void divisionError(int64_t lhs, int64_t rhs) {
+  std::cerr << "integer division " << lhs << " / " << rhs
+            << (rhs ? " overflows" : " by zero") << '\n';
+}
 
-    makeModule(state, jit);
-    auto fnIR = std::visit([&](auto &ast) { return ast.codegen(state); }, *ast);
+double putchard(double x) {
+  std::putchar(static_cast<char>(x));
+  std::fflush(stdout);
+  return 0;
+}
+
+double printd(double x) {
+  std::printf("%f\n", x);
+  std::fflush(stdout);
+  return 0;
+}
 
-    std::cout << "IR:\n";
-    fnIR->print(llvm::outs(), nullptr);
+double minHost(double a, double b) { return a < b ? a : b; }
+double maxHost(double a, double b) { return a > b ? a : b; }
 
-    auto modHandle = jit.addModule(std::move(state.llvmModule));
+// Functions every kjit session can call without an extern.
+host::Registry builtins() {
+  host::Registry registry;
+  registry.add({"putchard", reinterpret_cast<void *>(&putchard),
+                {ast::Type::F64}, ast::Type::F64, false, true});
+  registry.add({"printd", reinterpret_cast<void *>(&printd),
+                {ast::Type::F64}, ast::Type::F64, false, true});
+  registry.add({"min", reinterpret_cast<void *>(&minHost),
+                {ast::Type::F64, ast::Type::F64}, ast::Type::F64, true, true,
+                "define double @min(double %a, double %b) {\n"
+                "  %lt = fcmp olt double %a, %b\n"
+                "  %r = select i1 %lt, double %a, double %b\n"
+                "  ret double %r\n"
+                "}\n"});
+  registry.add({"max", reinterpret_cast<void *>(&maxHost),
+                {ast::Type::F64, ast::Type::F64}, ast::Type::F64, true, true,
+                "define double @max(double %a, double %b) {\n"
+                "  %gt = fcmp ogt double %a, %b\n"
+                "  %r = select i1 %gt, double %a, double %b\n"
+                "  ret double %r\n"
+                "}\n"});
+  return registry;
+}
 
-    auto exprSymbol = jit.findSymbol("__anon_expr");
-    if (exprSymbol) {
-      double (*fP)() = reinterpret_cast<double (*)()>(
-          static_cast<intptr_t>(llvm::cantFail(exprSymbol.getAddress())));
-      std::cout << "Eval:\n" << fP() << '\n';
-      jit.removeModule(modHandle);
+// Runs a source file, or one written by --emit-ast.
+int runFile(const std::string &path, session::Session &session) {
+  std::ifstream sourceStream(path);
+  if (!sourceStream) {
+    std::cerr << "unable to open " << path << '\n';
+    return 1;
+  }
+  char start[sizeof(serialize::magic)];
+  sourceStream.read(start, sizeof(start));
+  bool encoded = serialize::isEncoded(
+      std::string_view(start, static_cast<size_t>(sourceStream.gcount())));
+  sourceStream.clear();
+  sourceStream.seekg(0);
+  try {
+    if (encoded) {
+      session.run(serialize::load(path));
+    } else {
+      lexer::Lexer lexer{sourceStream};
+      session.run(lexer);
     }
+  } catch (const std::exception &e) {
+    std::cerr << path << ": " << e.what() << '\n';
+    return 1;
   }
+  return 0;
 }
 
-int main() {
+// Parses every input file and writes all of their items to --emit-ast.
+int emitASTFile() {
+  parser::Parser parser;
+  std::vector<std::unique_ptr<ast::AstNode>> items;
+  for (const auto &path : inputFiles) {
+    std::ifstream sourceStream(path);
+    if (!sourceStream) {
+      std::cerr << "unable to open " << path << '\n';
+      return 1;
+    }
+    try {
+      lexer::Lexer lexer{sourceStream};
+      while (true) {
+        while (lexer.peek() == tokens::Token{tokens::Character{';'}}) {
+          lexer.pop();
+        }
+        if (std::holds_alternative<tokens::Eof>(lexer.peek())) {
+          break;
+        }
+        items.push_back(parser.parse(lexer));
+      }
+    } catch (const std::exception &e) {
+      std::cerr << path << ": " << e.what() << '\n';
+      return 1;
+    }
+  }
+  std::ofstream out(emitAST, std::ios::binary);
+  out << serialize::encode(items);
+  if (!out) {
+    std::cerr << "unable to write " << emitAST << '\n';
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  cl::HideUnrelatedOptions(kjitCategory);
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT compiler\n");
+
+  if (!emitAST.empty()) {
+    return emitASTFile();
+  }
+
+  if (tiered && parallel) {
+    std::cerr << "--tiered and --parallel can't be combined\n";
+    return 1;
+  }
+
   llvm::InitializeNativeTarget();
   llvm::InitializeNativeTargetAsmPrinter();
   llvm::InitializeNativeTargetAsmParser();
 
-  ast::GenState state;
-  llvm::orc::KaleidoscopeJIT jit;
+  // Created first, since the JIT notifies it until it is gone.
+  std::unique_ptr<profiler::Profiler> profiler;
+  if (profile || !profileOutput.empty()) {
+    try {
+      profiler = std::make_unique<profiler::Profiler>();
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << '\n';
+      return 1;
+    }
+  }
+  // Writes the profile, if asked to, once kjit is done with status. Every
+  // return from here on goes through this, failures included.
+  auto finish = [&](int status) {
+    if (!profileOutput.empty()) {
+      std::ofstream profileStream(profileOutput);
+      profiler->writeFolded(profileStream);
+      if (!profileStream) {
+        std::cerr << "unable to write " << profileOutput << '\n';
+        return 1;
+      }
+    }
+    return status;
+  };
 
-  parser::Parser parser;
+  llvm::orc::KaleidoscopeJIT jit(targetCPU, targetFeatures);
+  jit.addHostSymbol(ast::boundsErrorSymbol,
+                    reinterpret_cast<uintptr_t>(&boundsError));
+  jit.addHostSymbol(ast::divisionErrorSymbol,
+                    reinterpret_cast<uintptr_t>(&divisionError));
+  host::Registry hostFunctions = builtins();
+  if (gdbRegistration) {
+    jit.enableGDBRegistration();
+  }
+  if (perfMap) {
+    jit.enablePerfMap();
+  }
+  if (profiler) {
+    jit.addEventListener(*profiler);
+  }
+
+  std::unique_ptr<llvm::ThreadPool> evalPool;
+  if (parallel) {
+    evalPool = std::make_unique<llvm::ThreadPool>(
+        parallelJobs ? static_cast<unsigned>(parallelJobs)
+                     : llvm::heavyweight_hardware_concurrency());
+  }
+
+  std::ofstream remarksStream;
+  std::unique_ptr<remarks::File> remarksOutput;
+  if (!remarksFile.empty()) {
+    remarksStream.open(remarksFile);
+    if (!remarksStream) {
+      std::cerr << "unable to open " << remarksFile << '\n';
+      return finish(1);
+    }
+    remarksOutput = std::make_unique<remarks::File>(remarksStream);
+  }
+
+  session::Options options;
+  options.evalPool = evalPool.get();
+  options.tiered = tiered;
+  options.tierUpThreshold = tierUpThreshold;
+  options.fpMode = fpMode;
+  options.boundsChecks = boundsChecks;
+  options.printIR = printIR;
+  options.preferVectorWidth = preferVectorWidth;
+  options.hostFunctions = &hostFunctions;
+  options.exprCacheSize = exprCacheSize;
+  options.evictAfter = std::chrono::seconds(evictAfter);
+  options.specializationBudget = specializationBudget;
+  options.recycleContextModules = recycleContextModules;
+  options.recycleContextBytes = static_cast<size_t>(recycleContextMB) << 20;
+  options.remarks = remarksOutput.get();
+  options.profiler = profiler.get();
+
+  if (!serveSocket.empty()) {
+    std::unique_ptr<session::Session> library;
+    if (!libraryFile.empty()) {
+      session::Options libraryOptions;
+      libraryOptions.fpMode = fpMode;
+      libraryOptions.boundsChecks = boundsChecks;
+      libraryOptions.preferVectorWidth = preferVectorWidth;
+      libraryOptions.hostFunctions = &hostFunctions;
+      libraryOptions.profiler = profiler.get();
+      library = std::make_unique<session::Session>(jit, libraryOptions,
+                                                   std::cout);
+      if (int err = runFile(libraryFile, *library)) {
+        return finish(err);
+      }
+    }
+    if (!maxClients) {
+      std::cerr << "--max-clients must be at least 1\n";
+      return finish(1);
+    }
+    return finish(server::serve(serveSocket, jit, options, library.get(),
+                                maxClients));
+  }
+
+  session::Session session(jit, options, std::cout);
+
+  if (watchFiles) {
+    if (inputFiles.empty()) {
+      std::cerr << "--watch needs input files\n";
+      return finish(1);
+    }
+    return finish(watch::watch(inputFiles, session));
+  }
+
+  if (!inputFiles.empty()) {
+    for (const auto &path : inputFiles) {
+      if (int err = runFile(path, session)) {
+        return finish(err);
+      }
+    }
+    return finish(0);
+  }
 
   while (true) {
     try {
       std::cout << "ready> ";
       std::string source;
-      std::getline(std::cin, source);
-      if (source == "exit") {
+      if (!std::getline(std::cin, source) || source == "exit") {
         break;
       }
+      if (session.runCommand(source)) {
+        continue;
+      }
       std::stringstream sourceStream(source);
       lexer::Lexer lexer{sourceStream};
 
-      parseAndExecuteTokenStream(lexer, parser, jit, state);
+      session.run(lexer);
     } catch (const std::exception &e) {
       std::cerr << e.what() << '\n';
     }
   }
 
-  return 0;
+  return finish(0);
 }
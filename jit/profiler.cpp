@@ -0,0 +1,354 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <iomanip>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "llvm/Object/SymbolSize.h"
+
+namespace {
+constexpr size_t numSlots = 8192;
+// Where samples outside every function the JIT loaded are charged: host
+// functions, the compiler itself and the bytecode interpreter.
+constexpr uint32_t host = 0;
+
+std::atomic<profiler::Profiler *> active{nullptr};
+// Signal handlers running right now, which may be using the profiler and
+// its published ranges.
+std::atomic<unsigned> inHandler{0};
+
+struct Registers {
+  uint64_t pc;
+  uint64_t fp;
+  uint64_t sp;
+};
+
+#if defined(__linux__) && defined(__x86_64__)
+constexpr bool supported = true;
+Registers registersOf(const ucontext_t &context) {
+  const auto &regs = context.uc_mcontext.gregs;
+  return {static_cast<uint64_t>(regs[REG_RIP]),
+          static_cast<uint64_t>(regs[REG_RBP]),
+          static_cast<uint64_t>(regs[REG_RSP])};
+}
+#elif defined(__linux__) && defined(__aarch64__)
+constexpr bool supported = true;
+Registers registersOf(const ucontext_t &context) {
+  const auto &regs = context.uc_mcontext;
+  return {regs.pc, regs.regs[29], regs.sp};
+}
+#else
+constexpr bool supported = false;
+Registers registersOf(const ucontext_t &) { return {}; }
+#endif
+
+// Reads the saved frame pointer and return address of the frame at fp. The
+// kernel does the reading, so a bad frame pointer fails instead of faulting.
+bool readFrame(uint64_t fp, uint64_t (&frame)[2]) {
+  iovec local{frame, sizeof(frame)};
+  iovec remote{reinterpret_cast<void *>(fp), sizeof(frame)};
+  return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) ==
+         static_cast<ssize_t>(sizeof(frame));
+}
+
+std::string percent(uint64_t count, uint64_t total) {
+  std::ostringstream text;
+  text << std::fixed << std::setprecision(1) << std::setw(5)
+       << 100.0 * count / total << '%';
+  return text.str();
+}
+} // namespace
+
+namespace profiler {
+std::string functionName(llvm::StringRef symbol) {
+  llvm::StringRef anon = "__anon_expr";
+  size_t at = symbol.find(anon);
+  if (at == llvm::StringRef::npos) {
+    return symbol.str();
+  }
+  return symbol.take_front(at + anon.size()).str();
+}
+
+Profiler::Profiler(std::chrono::microseconds interval)
+    : names{"[host]"}, ranges(std::make_unique<ranges_t>()),
+      slots(std::make_unique<Slot[]>(numSlots)) {
+  if (!supported) {
+    throw std::runtime_error("profiling is not supported on this platform");
+  }
+  publishedRanges = ranges.get();
+  Profiler *none = nullptr;
+  if (!active.compare_exchange_strong(none, this)) {
+    throw std::runtime_error("a profiler is already running");
+  }
+
+  struct sigaction action = {};
+  action.sa_sigaction = handleSignal;
+  action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, nullptr);
+
+  itimerval timer = {};
+  timer.it_interval.tv_sec = interval.count() / 1000000;
+  timer.it_interval.tv_usec = interval.count() % 1000000;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, nullptr);
+
+  collector = std::thread([this] {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopping.wait_for(lock, std::chrono::milliseconds(100),
+                              [this] { return stopped; })) {
+      collect();
+    }
+  });
+}
+
+Profiler::~Profiler() {
+  itimerval off = {};
+  setitimer(ITIMER_PROF, &off, nullptr);
+  // A signal still pending must not take the process down.
+  signal(SIGPROF, SIG_IGN);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopped = true;
+  }
+  stopping.notify_all();
+  collector.join();
+
+  active = nullptr;
+  while (inHandler) {
+    std::this_thread::yield();
+  }
+}
+
+void Profiler::notifyObjectLoaded(
+    ObjectKey k, const llvm::object::ObjectFile &obj,
+    const llvm::RuntimeDyld::LoadedObjectInfo &info) {
+  // Symbols of the debug object have their load addresses.
+  llvm::object::OwningBinary<llvm::object::ObjectFile> debugObj =
+      info.getObjectForDebug(obj);
+  if (!debugObj.getBinary()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  ranges_t loaded;
+  for (const auto &symSize :
+       llvm::object::computeSymbolSizes(*debugObj.getBinary())) {
+    const llvm::object::SymbolRef &sym = symSize.first;
+    auto type = sym.getType();
+    if (!type || *type != llvm::object::SymbolRef::ST_Function) {
+      llvm::consumeError(type.takeError());
+      continue;
+    }
+    auto name = sym.getName();
+    auto addr = sym.getAddress();
+    if (!name || !addr || !symSize.second) {
+      llvm::consumeError(name.takeError());
+      llvm::consumeError(addr.takeError());
+      continue;
+    }
+    loaded.push_back(
+        {*addr, *addr + symSize.second, intern(functionName(*name))});
+  }
+  objectRanges[k] = std::move(loaded);
+  publishRanges();
+}
+
+void Profiler::notifyFreeingObject(ObjectKey k) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (objectRanges.erase(k)) {
+    publishRanges();
+  }
+}
+
+void Profiler::print(std::ostream &out, size_t limit) {
+  std::lock_guard<std::mutex> lock(mutex);
+  collect();
+
+  // A function or call counts once per sample however often it is on the
+  // stack, so recursion doesn't inflate it.
+  std::vector<uint64_t> self(names.size()), total(names.size());
+  std::map<std::pair<uint32_t, uint32_t>, uint64_t> calls;
+  for (const auto &[stack, count] : stacks) {
+    self[stack.back()] += count;
+    std::set<uint32_t> seen;
+    std::set<std::pair<uint32_t, uint32_t>> seenCalls;
+    for (size_t i = 0; i < stack.size(); ++i) {
+      if (seen.insert(stack[i]).second) {
+        total[stack[i]] += count;
+      }
+      if (i && seenCalls.insert({stack[i - 1], stack[i]}).second) {
+        calls[{stack[i - 1], stack[i]}] += count;
+      }
+    }
+  }
+
+  out << samples << " samples";
+  if (dropped) {
+    out << ", " << dropped << " dropped";
+  }
+  out << '\n';
+  if (!samples) {
+    return;
+  }
+
+  std::vector<uint32_t> functions;
+  for (uint32_t i = 0; i < names.size(); ++i) {
+    if (total[i]) {
+      functions.push_back(i);
+    }
+  }
+  std::sort(functions.begin(), functions.end(), [&](uint32_t a, uint32_t b) {
+    return std::make_pair(self[a], total[a]) >
+           std::make_pair(self[b], total[b]);
+  });
+  functions.resize(std::min(functions.size(), limit));
+  out << "  self  total  function\n";
+  for (uint32_t function : functions) {
+    out << percent(self[function], samples) << ' '
+        << percent(total[function], samples) << "  " << names[function]
+        << '\n';
+  }
+
+  std::vector<std::pair<std::pair<uint32_t, uint32_t>, uint64_t>> hottest(
+      calls.begin(), calls.end());
+  std::sort(hottest.begin(), hottest.end(),
+            [](const auto &a, const auto &b) { return a.second > b.second; });
+  hottest.resize(std::min(hottest.size(), limit));
+  if (!hottest.empty()) {
+    out << "calls:\n";
+  }
+  for (const auto &[call, count] : hottest) {
+    out << percent(count, samples) << "  " << names[call.first] << " -> "
+        << names[call.second] << '\n';
+  }
+}
+
+void Profiler::writeFolded(std::ostream &out) {
+  std::lock_guard<std::mutex> lock(mutex);
+  collect();
+  for (const auto &[stack, count] : stacks) {
+    for (size_t i = 0; i < stack.size(); ++i) {
+      out << (i ? ";" : "") << names[stack[i]];
+    }
+    out << ' ' << count << '\n';
+  }
+}
+
+void Profiler::reset() {
+  std::lock_guard<std::mutex> lock(mutex);
+  collect();
+  stacks.clear();
+  samples = 0;
+  dropped = 0;
+}
+
+void Profiler::handleSignal(int, siginfo_t *, void *context) {
+  int savedErrno = errno;
+  ++inHandler;
+  if (Profiler *profiler = active) {
+    profiler->sample(context);
+  }
+  --inHandler;
+  errno = savedErrno;
+}
+
+// Runs in the signal handler, so it takes no locks and allocates nothing.
+void Profiler::sample(void *context) {
+  Registers regs = registersOf(*static_cast<ucontext_t *>(context));
+  Slot &slot = slots[nextSlot++ % numSlots];
+  int empty = Slot::Empty;
+  if (!slot.state.compare_exchange_strong(empty, Slot::Writing)) {
+    ++dropped;
+    return;
+  }
+
+  const ranges_t &current = *publishedRanges;
+  uint32_t function = functionAt(current, regs.pc);
+  slot.frames[0] = function;
+  slot.depth = 1;
+  // Only generated code is known to keep a frame pointer, so the walk stops
+  // at the first frame outside it. A sample taken in a host function called
+  // from generated code is charged to the host alone, without the JIT frames
+  // under it. One taken where a function has no frame of its own (before its
+  // prologue, after its epilogue, or in a loop of a leaf function that the
+  // compiler moved outside both) reads the caller's frame as the current
+  // one, so the caller is missing from its stack.
+  uint64_t fp = regs.fp;
+  uint64_t frame[2];
+  while (function != host && slot.depth < maxDepth && fp >= regs.sp &&
+         fp % sizeof(uint64_t) == 0 && readFrame(fp, frame)) {
+    // The return address is just past the call.
+    function = functionAt(current, frame[1] - 1);
+    if (function != host) {
+      slot.frames[slot.depth++] = function;
+    }
+    // Older frames are further up the stack.
+    if (frame[0] <= fp) {
+      break;
+    }
+    fp = frame[0];
+  }
+  slot.state = Slot::Full;
+}
+
+uint32_t Profiler::functionAt(const ranges_t &ranges, uint64_t address) const {
+  auto it = std::upper_bound(ranges.begin(), ranges.end(), address,
+                             [](uint64_t value, const Range &range) {
+                               return value < range.start;
+                             });
+  if (it == ranges.begin() || address >= (--it)->end) {
+    return host;
+  }
+  return it->function;
+}
+
+uint32_t Profiler::intern(std::string name) {
+  auto [it, added] = nameIds.emplace(std::move(name), names.size());
+  if (added) {
+    names.push_back(it->first);
+  }
+  return it->second;
+}
+
+void Profiler::publishRanges() {
+  auto next = std::make_unique<ranges_t>();
+  for (const auto &[k, loaded] : objectRanges) {
+    next->insert(next->end(), loaded.begin(), loaded.end());
+  }
+  std::sort(next->begin(), next->end(),
+            [](const Range &a, const Range &b) { return a.start < b.start; });
+  publishedRanges = next.get();
+  // Handlers that started before the switch may still be searching the old
+  // snapshot.
+  while (inHandler) {
+    std::this_thread::yield();
+  }
+  ranges = std::move(next);
+}
+
+void Profiler::collect() {
+  for (size_t i = 0; i < numSlots; ++i) {
+    Slot &slot = slots[i];
+    if (slot.state != Slot::Full) {
+      continue;
+    }
+    std::vector<uint32_t> stack(
+        std::make_reverse_iterator(slot.frames + slot.depth),
+        std::make_reverse_iterator(slot.frames));
+    ++stacks[stack];
+    ++samples;
+    slot.state = Slot::Empty;
+  }
+}
+} // namespace profiler
@@ -0,0 +1,108 @@
+#ifndef JIT_PROFILER_HPP_
+#define JIT_PROFILER_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/JITEventListener.h"
+#include "llvm/Object/ObjectFile.h"
+
+namespace profiler {
+// What samples in the function with this symbol are charged to. Every
+// top-level expression is compiled under a symbol of its own (ending in
+// __anon_expr.N, after any session prefix); they are all charged to one.
+std::string functionName(llvm::StringRef symbol);
+
+// A sampling profiler for JIT-compiled code. A CPU timer interrupts the
+// process with SIGPROF, and each sample is charged to the function whose
+// code the program counter is in, found among the functions of the objects
+// the JIT has loaded. Call stacks are walked through frame pointers, which
+// generated code only keeps when asked to (ast::GenState::framePointers).
+//
+// Sampling runs from construction to destruction; one profiler can run at a
+// time. It must be registered with the JIT before anything is compiled.
+class Profiler : public llvm::JITEventListener {
+public:
+  explicit Profiler(
+      std::chrono::microseconds interval = std::chrono::milliseconds(1));
+  ~Profiler() override;
+
+  void notifyObjectLoaded(ObjectKey k, const llvm::object::ObjectFile &obj,
+                          const llvm::RuntimeDyld::LoadedObjectInfo &info)
+      override;
+  void notifyFreeingObject(ObjectKey k) override;
+
+  // The flat profile of the limit hottest functions, then the calls between
+  // them that were on the stack most often.
+  void print(std::ostream &out, size_t limit = 20);
+  // Each distinct stack, outermost function first, with its sample count:
+  // the folded format flamegraph.pl and pprof read.
+  void writeFolded(std::ostream &out);
+  // Forgets the samples taken so far.
+  void reset();
+
+  static constexpr size_t maxDepth = 32;
+
+private:
+  // The code of one function, by its index in names.
+  struct Range {
+    uint64_t start;
+    uint64_t end;
+    uint32_t function;
+  };
+  using ranges_t = std::vector<Range>;
+
+  // Written by the signal handler, read back by collect.
+  struct Slot {
+    enum State { Empty, Writing, Full };
+    std::atomic<int> state{Empty};
+    uint32_t depth;
+    // Innermost first.
+    uint32_t frames[maxDepth];
+  };
+
+  static void handleSignal(int signal, siginfo_t *info, void *context);
+  void sample(void *context);
+  uint32_t functionAt(const ranges_t &ranges, uint64_t address) const;
+  uint32_t intern(std::string name);
+  // Both are called with mutex held.
+  void publishRanges();
+  void collect();
+
+  // Guards everything below but the atomics.
+  std::mutex mutex;
+  std::vector<std::string> names;
+  std::unordered_map<std::string, uint32_t> nameIds;
+  std::map<ObjectKey, ranges_t> objectRanges;
+  // What the signal handler searches: sorted, and never changed once
+  // published. A replaced snapshot is freed once no handler is reading it.
+  std::unique_ptr<ranges_t> ranges;
+  std::atomic<const ranges_t *> publishedRanges{nullptr};
+
+  std::unique_ptr<Slot[]> slots;
+  std::atomic<size_t> nextSlot{0};
+  std::atomic<uint64_t> dropped{0};
+  // Sample counts by stack, outermost function first.
+  std::map<std::vector<uint32_t>, uint64_t> stacks;
+  uint64_t samples = 0;
+
+  // Moves samples out of the slots before they fill up.
+  std::thread collector;
+  std::condition_variable stopping;
+  bool stopped = false;
+};
+} // namespace profiler
+
+#endif // !JIT_PROFILER_HPP_
@@ -0,0 +1,99 @@
+#include "remarks.hpp"
+
+#include "llvm/IR/Function.h"
+
+namespace {
+const char *kindName(remarks::Remark::Kind kind) {
+  switch (kind) {
+  case remarks::Remark::Passed:
+    return "passed";
+  case remarks::Remark::Missed:
+    return "missed";
+  case remarks::Remark::Analysis:
+    return "analysis";
+  }
+  return "";
+}
+
+// A single quoted YAML scalar, which only needs its quotes doubled.
+std::string quoted(const std::string &text) {
+  std::string result = "'";
+  for (char c : text) {
+    result += c;
+    if (c == '\'') {
+      result += c;
+    }
+  }
+  return result + "'";
+}
+} // namespace
+
+namespace remarks {
+Handler::Handler(sink_t sink) : sink(std::move(sink)) {}
+
+bool Handler::handleDiagnostics(const llvm::DiagnosticInfo &info) {
+  auto *optimization =
+      llvm::dyn_cast<llvm::DiagnosticInfoOptimizationBase>(&info);
+  if (!optimization) {
+    return false;
+  }
+  // Counts of instructions after every pass and of each instruction in
+  // every block, which would drown out the rest.
+  if (llvm::StringRef(optimization->getPassName()) == "size-info" ||
+      optimization->getRemarkName() == "InstructionMix") {
+    return true;
+  }
+
+  Remark remark;
+  remark.kind = optimization->isPassed()   ? Remark::Passed
+                : optimization->isMissed() ? Remark::Missed
+                                           : Remark::Analysis;
+  remark.pass = llvm::StringRef(optimization->getPassName()).str();
+  remark.name = optimization->getRemarkName().str();
+  remark.function = optimization->getFunction().getName().str();
+  remark.message = optimization->getMsg();
+  if (optimization->isLocationAvailable()) {
+    llvm::StringRef file;
+    optimization->getLocation(file, remark.line, remark.column);
+  }
+  sink(std::move(remark));
+  return true;
+}
+
+bool Handler::isAnalysisRemarkEnabled(llvm::StringRef passName) const {
+  return passName != "size-info";
+}
+
+bool Handler::isMissedOptRemarkEnabled(llvm::StringRef) const { return true; }
+
+bool Handler::isPassedOptRemarkEnabled(llvm::StringRef) const { return true; }
+
+bool Handler::isAnyRemarkEnabled() const { return true; }
+
+void print(std::ostream &out, const Remark &remark) {
+  if (remark.line) {
+    out << remark.line << ':' << remark.column << ": ";
+  }
+  out << kindName(remark.kind) << ' ' << remark.pass << ": " << remark.message
+      << '\n';
+}
+
+File::File(std::ostream &out) : out(out) {}
+
+void File::write(const Remark &remark) {
+  const char *tags[] = {"Passed", "Missed", "Analysis"};
+  std::lock_guard<std::mutex> lock(mutex);
+  out << "--- !" << tags[remark.kind] << '\n'
+      << "Pass:            " << quoted(remark.pass) << '\n'
+      << "Name:            " << quoted(remark.name) << '\n';
+  if (remark.line) {
+    out << "DebugLoc:        { File: kaleidoscope, Line: " << remark.line
+        << ", Column: " << remark.column << " }\n";
+  }
+  out << "Function:        " << quoted(remark.function) << '\n'
+      << "Args:\n"
+      << "  - String:          " << quoted(remark.message) << '\n'
+      << "...\n";
+  out.flush();
+}
+} // namespace remarks
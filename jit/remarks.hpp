@@ -0,0 +1,65 @@
+#ifndef JIT_REMARKS_HPP_
+#define JIT_REMARKS_HPP_
+
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+#include "llvm/IR/DiagnosticHandler.h"
+#include "llvm/IR/DiagnosticInfo.h"
+
+namespace remarks {
+// An optimization remark: what a pass did, failed to do, or found out.
+struct Remark {
+  enum Kind { Passed, Missed, Analysis };
+
+  Kind kind;
+  std::string pass;
+  std::string name;
+  // The symbol of the function it is about.
+  std::string function;
+  std::string message;
+  // Line 0 when the code had no source location.
+  unsigned line = 0;
+  unsigned column = 0;
+};
+
+// Hands every optimization remark in the context it is installed in to a
+// sink, which makes the passes produce them in the first place. Any other
+// diagnostic is handled as usual.
+class Handler : public llvm::DiagnosticHandler {
+public:
+  using sink_t = std::function<void(Remark)>;
+
+  explicit Handler(sink_t sink);
+
+  bool handleDiagnostics(const llvm::DiagnosticInfo &info) override;
+  bool isAnalysisRemarkEnabled(llvm::StringRef passName) const override;
+  bool isMissedOptRemarkEnabled(llvm::StringRef passName) const override;
+  bool isPassedOptRemarkEnabled(llvm::StringRef passName) const override;
+  bool isAnyRemarkEnabled() const override;
+
+private:
+  sink_t sink;
+};
+
+// [line:column: ]kind pass: message
+void print(std::ostream &out, const Remark &remark);
+
+// Remarks as a stream of YAML documents, in the format LLVM's own
+// -pass-remarks-output writes (so its tools can read it). Several sessions
+// can write to one.
+class File {
+public:
+  explicit File(std::ostream &out);
+
+  void write(const Remark &remark);
+
+private:
+  std::mutex mutex;
+  std::ostream &out;
+};
+} // namespace remarks
+
+#endif // !JIT_REMARKS_HPP_
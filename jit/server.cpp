@@ -0,0 +1,237 @@
+#include "server.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) { stopRequested = 1; }
+
+// The connections being served, each on a thread of its own.
+class Clients {
+public:
+  explicit Clients(size_t limit) : limit(limit) {}
+
+  // Waits until fewer than limit clients are connected, or a stop is
+  // requested; false for the latter.
+  bool waitForSlot() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stopRequested) {
+      reap();
+      if (clients.size() < limit) {
+        return true;
+      }
+      finished.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    return false;
+  }
+
+  // Serves client on a new thread, closing it once serve returns.
+  void start(int client, std::function<void(int)> serve) {
+    std::lock_guard<std::mutex> lock(mutex);
+    clients.emplace_back();
+    auto it = std::prev(clients.end());
+    it->fd = client;
+    it->thread = std::thread([this, it, serve = std::move(serve)] {
+      serve(it->fd);
+      std::lock_guard<std::mutex> lock(mutex);
+      close(it->fd);
+      it->done = true;
+      finished.notify_all();
+    });
+  }
+
+  // Disconnects every client still connected and waits for its thread.
+  void stopAll() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (auto &client : clients) {
+      if (!client.done) {
+        shutdown(client.fd, SHUT_RDWR);
+      }
+    }
+    while (!clients.empty()) {
+      reap();
+      if (!clients.empty()) {
+        finished.wait(lock);
+      }
+    }
+  }
+
+private:
+  struct Client {
+    int fd = -1;
+    std::thread thread;
+    bool done = false;
+  };
+
+  // Joins the threads of clients that have disconnected. Called with mutex
+  // held; those threads have nothing left to do but return.
+  void reap() {
+    for (auto it = clients.begin(); it != clients.end();) {
+      if (it->done) {
+        it->thread.join();
+        it = clients.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  const size_t limit;
+  std::mutex mutex;
+  std::condition_variable finished;
+  std::list<Client> clients;
+};
+
+bool sendAll(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    sent += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+void serveClient(int client, llvm::orc::KaleidoscopeJIT &jit,
+                 const session::Options &options,
+                 const session::Session *library) {
+  std::ostringstream out;
+  {
+    session::Session session(jit, options, out);
+    if (library) {
+      session.importLibrary(*library);
+    }
+
+    std::string buffer;
+    char chunk[4096];
+    bool open = sendAll(client, "ready> ");
+    while (open) {
+      ssize_t n = read(client, chunk, sizeof(chunk));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      buffer.append(chunk, static_cast<size_t>(n));
+
+      size_t eol;
+      while (open && (eol = buffer.find('\n')) != std::string::npos) {
+        std::string line = buffer.substr(0, eol);
+        buffer.erase(0, eol + 1);
+        if (!line.empty() && line.back() == '\r') {
+          line.pop_back();
+        }
+        if (line == "exit") {
+          open = false;
+          break;
+        }
+
+        try {
+          if (!session.runCommand(line)) {
+            std::stringstream sourceStream(line);
+            lexer::Lexer lexer{sourceStream};
+            session.run(lexer);
+          }
+        } catch (const std::exception &e) {
+          out << e.what() << '\n';
+        }
+        out << "ready> ";
+        open = sendAll(client, out.str());
+        out.str("");
+      }
+    }
+  }
+}
+} // namespace
+
+namespace server {
+int serve(const std::string &path, llvm::orc::KaleidoscopeJIT &jit,
+          const session::Options &options, const session::Session *library,
+          size_t maxClients) {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "socket path too long: " << path << '\n';
+    return 1;
+  }
+  std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    std::cerr << "socket: " << std::strerror(errno) << '\n';
+    return 1;
+  }
+  unlink(path.c_str());
+  if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+      listen(fd, SOMAXCONN) < 0) {
+    std::cerr << path << ": " << std::strerror(errno) << '\n';
+    close(fd);
+    return 1;
+  }
+
+  struct sigaction action = {};
+  action.sa_handler = requestStop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  Clients clients(maxClients);
+  size_t nextSession = 0;
+  int status = 0;
+  // Polling with a timeout notices a stop whichever thread got the signal.
+  while (clients.waitForSlot()) {
+    pollfd listening{fd, POLLIN, 0};
+    int ready = poll(&listening, 1, 100);
+    if (ready <= 0) {
+      if (ready < 0 && errno != EINTR) {
+        std::cerr << "poll: " << std::strerror(errno) << '\n';
+        status = 1;
+        break;
+      }
+      continue;
+    }
+    int client = accept(fd, nullptr, nullptr);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      std::cerr << "accept: " << std::strerror(errno) << '\n';
+      status = 1;
+      break;
+    }
+
+    // Sessions get their own symbol namespace on the shared JIT.
+    session::Options sessionOptions = options;
+    sessionOptions.symbolPrefix = "s" + std::to_string(++nextSession) + ".";
+    clients.start(client, [&jit, sessionOptions, library](int client) {
+      serveClient(client, jit, sessionOptions, library);
+    });
+  }
+
+  close(fd);
+  unlink(path.c_str());
+  clients.stopAll();
+  return status;
+}
+} // namespace server
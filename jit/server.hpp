@@ -0,0 +1,21 @@
+#ifndef JIT_SERVER_HPP_
+#define JIT_SERVER_HPP_
+
+#include <string>
+
+#include "kaleidoscope_jit.hpp"
+#include "session.hpp"
+
+namespace server {
+// Accepts clients on a Unix domain socket at path, giving each connection its
+// own session on the shared JIT. Clients send source a line at a time and get
+// back what the REPL would have printed. Each connection is served, compiling
+// included, on a thread of its own; at most maxClients are served at once,
+// and further ones wait to be accepted. Returns on SIGINT or SIGTERM, or if
+// the socket fails, once every connection is closed and its thread joined.
+int serve(const std::string &path, llvm::orc::KaleidoscopeJIT &jit,
+          const session::Options &options, const session::Session *library,
+          size_t maxClients);
+} // namespace server
+
+#endif // !JIT_SERVER_HPP_
@@ -0,0 +1,1217 @@
+#include "session.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <future>
+#include <iomanip>
+#include <sstream>
+#include <unordered_set>
+
+#include "bench.hpp"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_os_ostream.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Vectorize.h"
+
+namespace legacy = llvm::legacy;
+
+namespace {
+bool isTopLevelExpr(const ast::AstNode &ast) {
+  auto *function = std::get_if<ast::Function>(&ast);
+  return function && function->proto->name == "__anon_expr";
+}
+
+bool sameSignature(const ast::Prototype &a, const ast::Prototype &b) {
+  return a.argTypes == b.argTypes && a.retType == b.retType;
+}
+
+// Charges what a context uniqued for the modules measured with it: the types,
+// constants and metadata they refer to, which stay in the context once the
+// modules are gone. Each is charged once, however many modules share it.
+class ContextMeter {
+public:
+  ContextMeter(std::unordered_set<const void *> &seen, size_t &bytes)
+      : seen(seen), bytes(bytes) {}
+
+  void measure(const llvm::Module &module) {
+    llvm::SmallVector<std::pair<unsigned, llvm::MDNode *>, 4> attached;
+    for (const auto &function : module) {
+      measure(function.getFunctionType());
+      for (const auto &block : function) {
+        for (const auto &inst : block) {
+          measure(inst.getType());
+          for (const auto &operand : inst.operands()) {
+            if (auto *constant = llvm::dyn_cast<llvm::Constant>(operand)) {
+              measure(constant);
+            } else if (auto *metadata =
+                           llvm::dyn_cast<llvm::MetadataAsValue>(operand)) {
+              if (charge(metadata, sizeof(llvm::MetadataAsValue))) {
+                measure(metadata->getMetadata());
+              }
+            }
+          }
+          inst.getAllMetadata(attached);
+          for (const auto &[kind, node] : attached) {
+            measure(node);
+          }
+        }
+      }
+    }
+  }
+
+private:
+  bool charge(const void *object, size_t size) {
+    if (!seen.insert(object).second) {
+      return false;
+    }
+    bytes += size;
+    return true;
+  }
+
+  void measure(const llvm::Type *type) {
+    if (!charge(type, sizeof(llvm::Type) +
+                          type->getNumContainedTypes() * sizeof(type))) {
+      return;
+    }
+    for (const auto *contained : type->subtypes()) {
+      measure(contained);
+    }
+  }
+
+  void measure(const llvm::Constant *constant) {
+    // Functions and globals belong to their module.
+    if (llvm::isa<llvm::GlobalValue>(constant) ||
+        !charge(constant, sizeof(llvm::ConstantFP) +
+                              constant->getNumOperands() *
+                                  sizeof(llvm::Use))) {
+      return;
+    }
+    measure(constant->getType());
+    for (const auto &operand : constant->operands()) {
+      if (auto *inner = llvm::dyn_cast<llvm::Constant>(operand)) {
+        measure(inner);
+      }
+    }
+  }
+
+  void measure(const llvm::Metadata *metadata) {
+    if (auto *string = llvm::dyn_cast<llvm::MDString>(metadata)) {
+      charge(string, sizeof(llvm::MDString) + string->getLength());
+    } else if (auto *value = llvm::dyn_cast<llvm::ConstantAsMetadata>(
+                   metadata)) {
+      if (charge(value, sizeof(llvm::ConstantAsMetadata))) {
+        measure(value->getValue());
+      }
+    } else if (auto *node = llvm::dyn_cast<llvm::MDNode>(metadata)) {
+      if (!charge(node, sizeof(llvm::MDNode) +
+                            node->getNumOperands() * sizeof(llvm::MDOperand))) {
+        return;
+      }
+      for (const auto &operand : node->operands()) {
+        if (operand) {
+          measure(operand.get());
+        }
+      }
+    }
+  }
+
+  std::unordered_set<const void *> &seen;
+  size_t &bytes;
+};
+} // namespace
+
+namespace session {
+Session::Session(llvm::orc::KaleidoscopeJIT &jit, const Options &options,
+                 std::ostream &out)
+    : jit(jit), targetMachine(jit.createTargetMachine()), options(options),
+      out(out) {
+  state.fpMode = options.fpMode;
+  state.symbolPrefix = options.symbolPrefix;
+  state.boundsChecks = options.boundsChecks;
+  state.preferVectorWidth = options.preferVectorWidth;
+  state.hostFunctions = options.hostFunctions;
+  state.debugLocations = options.remarks != nullptr;
+  state.framePointers = options.profiler != nullptr;
+  watchRemarks();
+  if (options.hostFunctions) {
+    for (const auto &[name, function] : options.hostFunctions->functions()) {
+      jit.addHostSymbol(name, static_cast<llvm::JITTargetAddress>(
+                                  reinterpret_cast<uintptr_t>(
+                                      function.address)));
+    }
+  }
+  if (options.tiered) {
+    setupTiers();
+  }
+}
+
+Session::~Session() {
+  for (auto modHandle : modules) {
+    unload(modHandle);
+  }
+  for (const auto &[name, def] : definitions) {
+    if (!def.evicted) {
+      unload(def.module);
+    }
+  }
+  for (const auto &cached : exprCache) {
+    unload(cached.modHandle);
+  }
+  for (const auto &[key, spec] : specializations) {
+    unload(spec.module);
+  }
+}
+
+void Session::importLibrary(const Session &library) {
+  for (const auto &[name, proto] : library.state.functionProtos) {
+    if (name.rfind("__anon_expr", 0) == 0) {
+      continue;
+    }
+    auto imported = std::make_unique<ast::Prototype>(*proto);
+    // Bind to the library's symbol rather than one of our own.
+    imported->name = proto->symbolName(library.state);
+    imported->isExtern = true;
+    state.functionProtos[name] = std::move(imported);
+  }
+}
+
+void Session::makeModule() {
+  state.llvmModule =
+      std::make_unique<llvm::Module>("KaleidoscopeJIT", *state.context);
+  state.llvmModule->setDataLayout(targetMachine->createDataLayout());
+  state.optPasses =
+      std::make_unique<legacy::FunctionPassManager>(state.llvmModule.get());
+  // The vectorizer and unroller need the target's cost model.
+  state.optPasses->add(llvm::createTargetTransformInfoWrapperPass(
+      targetMachine->getTargetIRAnalysis()));
+  state.optPasses->add(llvm::createInstructionCombiningPass());
+  state.optPasses->add(llvm::createReassociatePass());
+  state.optPasses->add(llvm::createGVNPass());
+  state.optPasses->add(llvm::createCFGSimplificationPass());
+  state.optPasses->add(llvm::createLoopRotatePass());
+  state.optPasses->add(llvm::createLICMPass());
+  state.optPasses->add(llvm::createIndVarSimplifyPass());
+  state.optPasses->add(llvm::createLoopVectorizePass());
+  state.optPasses->add(llvm::createLoopUnrollPass());
+  state.optPasses->add(llvm::createInstructionCombiningPass());
+  state.optPasses->add(llvm::createCFGSimplificationPass());
+  state.optPasses->doInitialization();
+}
+
+llvm::orc::VModuleKey Session::compile(ast::AstNode &ast, bool printIR) {
+  // Specializations get modules of their own, which have to exist before
+  // the calls to them are emitted. Top-level expressions run once, so
+  // specializing their calls would only cost compile time.
+  auto *function = std::get_if<ast::Function>(&ast);
+  if (function && function->proto->name.rfind("__anon_expr", 0) != 0) {
+    specializeCalls(*function);
+  }
+  makeModule();
+  auto fnIR = std::visit([&](auto &ast) { return ast.codegen(state); }, ast);
+  return finishModule(fnIR, printIR);
+}
+
+// Links the module fnIR was generated into, accounting for what it took.
+llvm::orc::VModuleKey Session::finishModule(llvm::Function *fnIR,
+                                            bool printIR) {
+  if (printIR) {
+    llvm::raw_os_ostream irOut(out);
+    out << "IR:\n";
+    fnIR->print(irOut, nullptr);
+  }
+
+  ast::Footprint ir;
+  for (const auto &function : *state.llvmModule) {
+    ir.bytes += sizeof(llvm::Function);
+    for (const auto &block : function) {
+      ir.bytes += sizeof(llvm::BasicBlock);
+      for (const auto &inst : block) {
+        ++ir.count;
+        ir.bytes += sizeof(llvm::Instruction) +
+                    inst.getNumOperands() * sizeof(llvm::Use);
+      }
+    }
+  }
+
+  ContextMeter(contextUniqued, contextBytes).measure(*state.llvmModule);
+
+  auto modHandle = jit.addModule(std::move(state.llvmModule));
+  irFootprints[modHandle] = ir;
+
+  ++contextModules;
+  if ((options.recycleContextModules &&
+       contextModules >= options.recycleContextModules) ||
+      (options.recycleContextBytes &&
+       contextBytes >= options.recycleContextBytes)) {
+    state.resetContext();
+    watchRemarks();
+    contextUniqued.clear();
+    contextBytes = 0;
+    contextModules = 0;
+  }
+  return modHandle;
+}
+
+// Specializes the definitions function calls on the constants it passes
+// them, for as long as the budget lasts. Every call passing the same
+// constants shares one specialization.
+void Session::specializeCalls(const ast::Function &function) {
+  if (!options.specializationBudget) {
+    return;
+  }
+
+  std::vector<const ast::expr::Call *> calls;
+  ast::expr::collectCalls(*function.body, calls);
+  for (const auto *call : calls) {
+    auto def = definitions.find(call->callee);
+    if (def == definitions.end() || redefining.count(call->callee) ||
+        call->args.size() != def->second.proto->args.size()) {
+      continue;
+    }
+    const auto &proto = *def->second.proto;
+    auto constants = ast::constantArguments(*call, proto);
+    if (std::none_of(constants.begin(), constants.end(),
+                     [](const auto &constant) { return constant; })) {
+      continue;
+    }
+    auto key = ast::specializationKey(call->callee, constants);
+    if (specializations.count(key)) {
+      continue;
+    }
+
+    // Folding constants seldom makes a clone bigger than its source, so the
+    // IR of the definition is a fair estimate (once it is evicted, there is
+    // only the clone's own to go by).
+    auto source = irFootprints.find(def->second.module);
+    if (source != irFootprints.end() &&
+        specializedSize + source->second.count >
+            options.specializationBudget) {
+      continue;
+    }
+
+    auto &body = *std::get<ast::Function>(*def->second.ast).body;
+    Specialization spec{call->callee, std::move(constants),
+                        call->callee + ".spec" +
+                            std::to_string(specializationCount++)};
+    spec.module = compileSpecialization(spec, proto, body);
+    spec.size = irFootprints[spec.module].count;
+    if (specializedSize + spec.size > options.specializationBudget) {
+      unload(spec.module);
+      state.specializations.erase(key);
+      continue;
+    }
+    specializedSize += spec.size;
+    auto symbol = state.specializations[key]->symbolName(state);
+    jit.addStub(symbol);
+    jit.redirectStub(symbol, spec.module);
+    specializations.emplace(std::move(key), std::move(spec));
+  }
+}
+
+llvm::orc::VModuleKey
+Session::compileSpecialization(const Specialization &spec,
+                               const ast::Prototype &proto,
+                               ast::expr::ExprNode &body) {
+  makeModule();
+  auto fnIR = ast::codegenSpecialization(state, proto, body, spec.name,
+                                         spec.constants);
+  return finishModule(fnIR, false);
+}
+
+void Session::unload(llvm::orc::VModuleKey modHandle) {
+  jit.removeModule(modHandle);
+  irFootprints.erase(modHandle);
+}
+
+bool Session::runCommand(const std::string &line) {
+  if (line.empty() || line[0] != ':') {
+    return false;
+  }
+
+  std::istringstream words(line.substr(1));
+  std::string command, argument;
+  words >> command;
+  std::getline(words >> std::ws, argument);
+  if (command == "mem" && (argument.empty() || argument == "json")) {
+    printMemoryUsage(argument == "json");
+  } else if (command == "target" && argument.empty()) {
+    const auto &tm = jit.getTargetMachine();
+    out << tm.getTargetTriple().str() << ' ' << tm.getTargetCPU().str() << ' '
+        << tm.getTargetFeatureString().str() << '\n';
+  } else if ((command == "ir" || command == "asm") && !argument.empty()) {
+    printCode(argument, command == "asm" ? Listing::Assembly : Listing::IR);
+  } else if (command == "remarks" && !argument.empty()) {
+    printCode(argument, Listing::Remarks);
+  } else if ((command == "time" || command == "bench") && !argument.empty()) {
+    timeExpr(argument, command == "bench");
+  } else if (command == "profile" &&
+             (argument.empty() || argument == "folded" ||
+              argument == "reset")) {
+    if (!options.profiler) {
+      throw std::runtime_error("not profiling (start kjit with --profile)");
+    }
+    if (argument == "folded") {
+      options.profiler->writeFolded(out);
+    } else if (argument == "reset") {
+      options.profiler->reset();
+    } else {
+      options.profiler->print(out);
+    }
+  } else {
+    throw std::runtime_error("unknown command: " + line);
+  }
+  return true;
+}
+
+// Generates the named function again, as it was compiled, into a module
+// that is printed instead of loaded. Its remarks are collected while it is
+// generated with debug locations and compiled to assembly that is dropped.
+void Session::printCode(const std::string &name, Listing listing) {
+  ast::Function *function;
+  const ast::Prototype *proto;
+  if (auto def = definitions.find(name); def != definitions.end()) {
+    function = &std::get<ast::Function>(*def->second.ast);
+    proto = def->second.proto.get();
+  } else if (auto cold = coldDefs.find(name); cold != coldDefs.end()) {
+    function = &std::get<ast::Function>(*cold->second);
+    proto = function->proto.get();
+  } else {
+    throw std::runtime_error("unknown function: " + name);
+  }
+
+  std::vector<remarks::Remark> collected;
+  std::unique_ptr<llvm::DiagnosticHandler> handler;
+  bool debugLocations = state.debugLocations;
+  if (listing == Listing::Remarks) {
+    handler = state.context->getDiagnosticHandler();
+    state.context->setDiagnosticHandler(
+        std::make_unique<remarks::Handler>([&](remarks::Remark remark) {
+          collected.push_back(std::move(remark));
+        }));
+    state.debugLocations = true;
+  }
+
+  // Codegen takes the prototype it is given.
+  auto kept = std::move(function->proto);
+  function->proto = std::make_unique<ast::Prototype>(*proto);
+  auto restore = [&] {
+    function->proto = std::move(kept);
+    if (listing == Listing::Remarks) {
+      state.context->setDiagnosticHandler(std::move(handler));
+      state.debugLocations = debugLocations;
+    }
+  };
+  llvm::SmallString<0> text;
+  try {
+    makeModule();
+    llvm::Function *fnIR = function->codegen(state);
+    auto module = std::move(state.llvmModule);
+    if (listing == Listing::IR) {
+      llvm::raw_os_ostream irOut(out);
+      fnIR->print(irOut, nullptr);
+    } else {
+      llvm::raw_svector_ostream asmOut(text);
+      jit.printAssembly(*module, asmOut);
+    }
+  } catch (...) {
+    restore();
+    throw;
+  }
+  restore();
+
+  if (listing == Listing::Assembly) {
+    out << text.str().str();
+  }
+  for (const auto &remark : collected) {
+    remarks::print(out, remark);
+  }
+}
+
+// Sends the remarks of everything compiled in the current context to the
+// remarks file, if there is one.
+void Session::watchRemarks() {
+  if (!options.remarks) {
+    return;
+  }
+  state.context->setDiagnosticHandler(
+      std::make_unique<remarks::Handler>([this](remarks::Remark remark) {
+        if (remark.function.rfind(state.symbolPrefix, 0) == 0) {
+          remark.function.erase(0, state.symbolPrefix.size());
+        }
+        options.remarks->write(remark);
+      }));
+}
+
+// Compiles and runs the expression in source on its own, reporting how long
+// compiling and running took; a benchmark runs it repeatedly instead, as many
+// times as the number after it says.
+void Session::timeExpr(const std::string &source, bool benchmark) {
+  std::istringstream sourceStream(source);
+  lexer::Lexer lexer{sourceStream};
+  auto start = clock::now();
+  auto ast = parser.parse(lexer);
+  auto parseTime = clock::now() - start;
+  size_t iterations = 0;
+  if (benchmark) {
+    auto next = lexer.peek();
+    if (auto *count = std::get_if<tokens::Number>(&next)) {
+      if (!(count->val >= 1 && count->val <= bench::maxIterations) ||
+          count->val != std::trunc(count->val)) {
+        throw std::runtime_error("calls must be a whole number from 1 to " +
+                                 std::to_string(bench::maxIterations));
+      }
+      iterations = static_cast<size_t>(count->val);
+      lexer.pop();
+    }
+  }
+  if (!isTopLevelExpr(*ast) ||
+      !std::holds_alternative<tokens::Eof>(lexer.peek())) {
+    throw std::runtime_error(benchmark ? "usage: :bench <expression> [calls]"
+                                       : "usage: :time <expression>");
+  }
+
+  auto expr = compileExpr(*ast);
+  if (benchmark) {
+    auto result = bench::run(expr.fP, iterations);
+    unload(expr.modHandle);
+    bench::print(out, result);
+    return;
+  }
+  start = clock::now();
+  double result = expr.fP();
+  auto runTime = clock::now() - start;
+  unload(expr.modHandle);
+  out << "Eval:\n" << result << '\n'
+      << "parse " << bench::format(parseTime) << ", compile "
+      << bench::format(expr.compileTime) << ", run "
+      << bench::format(runTime) << '\n';
+}
+
+// Compiles a top-level expression under a symbol of its own, down to
+// machine code, timing just that.
+Session::TimedExpr Session::compileExpr(ast::AstNode &ast) {
+  auto &function = std::get<ast::Function>(ast);
+  std::vector<std::string> callees;
+  ast::expr::collectCallees(*function.body, callees);
+  markUsed(callees);
+  if (interp) {
+    compileColdDefs(callees);
+  }
+
+  std::string exprName =
+      "__anon_expr." + std::to_string(state.anonExprCount++);
+  function.proto->name = exprName;
+  auto start = clock::now();
+  auto modHandle = compile(ast, false);
+  state.functionProtos.erase(exprName);
+  auto fP = reinterpret_cast<expr_fn_t>(
+      nativeAddress(state.symbolPrefix + exprName));
+  return {modHandle, fP, clock::now() - start};
+}
+
+void Session::printMemoryUsage(bool json) {
+  ast::Footprint astUsage;
+  for (const auto &[name, def] : definitions) {
+    def.proto->measure(astUsage);
+    ast::expr::measure(*std::get<ast::Function>(*def.ast).body, astUsage);
+  }
+  for (const auto &[name, ast] : coldDefs) {
+    ast::expr::measure(*std::get<ast::Function>(*ast).body, astUsage);
+  }
+
+  ast::Footprint irUsage;
+  ast::Footprint code;
+  ast::Footprint data;
+  auto addModule = [&](llvm::orc::VModuleKey modHandle) {
+    auto ir = irFootprints[modHandle];
+    irUsage.count += ir.count;
+    irUsage.bytes += ir.bytes;
+    auto sections = jit.getSectionUsage(modHandle);
+    code.count += sections.codeSections;
+    code.bytes += sections.codeBytes;
+    data.count += sections.dataSections;
+    data.bytes += sections.dataBytes;
+  };
+  for (auto modHandle : modules) {
+    addModule(modHandle);
+  }
+  for (const auto &[name, def] : definitions) {
+    if (!def.evicted) {
+      addModule(def.module);
+    }
+  }
+  for (const auto &cached : exprCache) {
+    addModule(cached.modHandle);
+  }
+  for (const auto &[key, spec] : specializations) {
+    addModule(spec.module);
+  }
+
+  ast::Footprint symbols;
+  for (const auto &[name, proto] : state.functionProtos) {
+    proto->measure(symbols);
+  }
+  for (const auto &[key, proto] : state.specializations) {
+    proto->measure(symbols);
+  }
+
+  const std::pair<const char *, ast::Footprint> rows[] = {
+      {"ast", astUsage},
+      {"ir", irUsage},
+      {"jit_code", code},
+      {"jit_data", data},
+      {"symbols", symbols},
+      {"context", {contextModules, contextBytes}},
+      {"heap", {0, llvm::sys::Process::GetMallocUsage()}},
+  };
+
+  if (json) {
+    const char *separator = "{";
+    for (const auto &[name, usage] : rows) {
+      out << separator << '"' << name << "\":{\"count\":" << usage.count
+          << ",\"bytes\":" << usage.bytes << '}';
+      separator = ",";
+    }
+    out << "}\n";
+    return;
+  }
+
+  out << std::left << std::setw(10) << "category" << std::right
+      << std::setw(10) << "count" << std::setw(14) << "bytes" << '\n';
+  for (const auto &[name, usage] : rows) {
+    out << std::left << std::setw(10) << name << std::right << std::setw(10)
+        << usage.count << std::setw(14) << usage.bytes << '\n';
+  }
+}
+
+// Identifies the code function compiles to: its structure plus the
+// generation of everything it calls, since a call is bound to whatever the
+// callee was when it was compiled.
+std::string Session::cacheKey(const ast::Function &function) const {
+  std::string key;
+  function.proto->fingerprint(key);
+  ast::expr::fingerprint(*function.body, key);
+  std::vector<std::string> callees;
+  ast::expr::collectCallees(*function.body, callees);
+  for (const auto &callee : callees) {
+    // Recursive calls always reach the function itself.
+    if (callee == function.proto->name) {
+      continue;
+    }
+    auto it = generations.find(callee);
+    uint64_t generation = it != generations.end() ? it->second : 0;
+    key.append(reinterpret_cast<const char *>(&generation),
+               sizeof(generation));
+  }
+  return key;
+}
+
+const Session::CachedExpr *Session::findCachedExpr(const std::string &key) {
+  auto it = exprCacheIndex.find(key);
+  if (it == exprCacheIndex.end()) {
+    return nullptr;
+  }
+  exprCache.splice(exprCache.begin(), exprCache, it->second);
+  exprCache.front().lastUsed = clock::now();
+  return &exprCache.front();
+}
+
+void Session::cacheExpr(std::string key, llvm::orc::VModuleKey modHandle,
+                        expr_fn_t fP) {
+  // The same expression read twice in one parallel batch is compiled twice.
+  if (exprCacheIndex.count(key)) {
+    unload(modHandle);
+    return;
+  }
+  exprCache.push_front({std::move(key), modHandle, fP, clock::now()});
+  exprCacheIndex[exprCache.front().key] = exprCache.begin();
+  if (exprCache.size() > options.exprCacheSize) {
+    unload(exprCache.back().modHandle);
+    exprCacheIndex.erase(exprCache.back().key);
+    exprCache.pop_back();
+  }
+}
+
+// Every definition or cold definition the named functions can call, directly
+// or not, including themselves.
+std::unordered_set<std::string>
+Session::reachableFrom(std::vector<std::string> roots) const {
+  std::unordered_set<std::string> seen;
+  while (!roots.empty()) {
+    std::string name = std::move(roots.back());
+    roots.pop_back();
+    if (!seen.insert(name).second) {
+      continue;
+    }
+    auto it = definitions.find(name);
+    if (it != definitions.end()) {
+      roots.insert(roots.end(), it->second.callees.begin(),
+                   it->second.callees.end());
+    } else if (coldDefs.count(name)) {
+      const auto &callees = interp->callees(name);
+      roots.insert(roots.end(), callees.begin(), callees.end());
+    }
+  }
+  return seen;
+}
+
+// Marks everything the named functions can call as used now, first
+// recompiling whatever of it has been evicted. Refuses if any of it calls a
+// function that was declared but never defined.
+void Session::markUsed(const std::vector<std::string> &roots) {
+  auto now = clock::now();
+  std::vector<std::string> reload;
+  for (const auto &name : reachableFrom(roots)) {
+    auto it = definitions.find(name);
+    if (it == definitions.end()) {
+      auto protoIt = state.functionProtos.find(name);
+      if (undefined.count(name) ||
+          (!coldDefs.count(name) && protoIt != state.functionProtos.end() &&
+           !jit.getSymbolAddress(protoIt->second->symbolName(state)))) {
+        throw std::runtime_error("undefined function " + name);
+      }
+      continue;
+    }
+    it->second.lastUsed = now;
+    if (it->second.evicted) {
+      reload.push_back(name);
+    }
+  }
+
+  std::vector<llvm::orc::VModuleKey> compiled;
+  try {
+    for (const auto &name : reload) {
+      auto &def = definitions[name];
+      std::get<ast::Function>(*def.ast).proto =
+          std::make_unique<ast::Prototype>(*def.proto);
+      compiled.push_back(compile(*def.ast, false));
+    }
+  } catch (...) {
+    for (auto modHandle : compiled) {
+      unload(modHandle);
+    }
+    throw;
+  }
+  for (size_t i = 0; i < reload.size(); ++i) {
+    auto &def = definitions[reload[i]];
+    jit.redirectStub(def.proto->symbolName(state), compiled[i]);
+    def.module = compiled[i];
+    def.evicted = false;
+  }
+}
+
+// Unloads the definitions unused for options.evictAfter that nothing used
+// since can call, along with the specializations of any of them and cached
+// expressions unused for as long. Their ASTs stay, so an evicted definition
+// can be recompiled by markUsed. Cold definitions only keep what they call
+// loaded while they are in use: markUsed reloads it before they run.
+void Session::evictIdle() {
+  if (options.evictAfter == std::chrono::seconds::zero()) {
+    return;
+  }
+  auto cutoff = clock::now() - options.evictAfter;
+
+  std::vector<std::string> roots;
+  for (const auto &[name, def] : definitions) {
+    if (!def.evicted && def.lastUsed >= cutoff) {
+      roots.push_back(name);
+    }
+  }
+  auto live = reachableFrom(std::move(roots));
+  for (auto &[name, def] : definitions) {
+    if (def.evicted || live.count(name)) {
+      continue;
+    }
+    jit.clearStub(def.proto->symbolName(state));
+    unload(def.module);
+    def.evicted = true;
+  }
+  // Whatever calls a specialization also reaches its callee. Evicted
+  // callers that need one again make it anew when they are recompiled.
+  for (auto it = specializations.begin(); it != specializations.end();) {
+    if (live.count(it->second.callee)) {
+      ++it;
+      continue;
+    }
+    jit.clearStub(state.specializations[it->first]->symbolName(state));
+    unload(it->second.module);
+    specializedSize -= it->second.size;
+    state.specializations.erase(it->first);
+    it = specializations.erase(it);
+  }
+
+  for (auto it = exprCache.begin(); it != exprCache.end();) {
+    if (it->lastUsed >= cutoff) {
+      ++it;
+      continue;
+    }
+    unload(it->modHandle);
+    exprCacheIndex.erase(it->key);
+    it = exprCache.erase(it);
+  }
+}
+
+// Compiles a batch of named functions (which may call each other) and swaps
+// them in behind their stubs. A changed signature also recompiles the direct
+// callers, whose calls were emitted against the old one, and drops its
+// specializations. Other specializations of recompiled functions are
+// recompiled too. Nothing is swapped in unless everything compiled.
+void Session::define(std::vector<std::unique_ptr<ast::AstNode>> functions,
+                     bool printIR) {
+  std::vector<std::string> names;
+  std::vector<std::string> keys;
+  std::vector<std::vector<std::string>> callees;
+  std::unordered_set<std::string> stale;
+  std::unordered_set<std::string> changed;
+  for (const auto &ast : functions) {
+    const auto &function = std::get<ast::Function>(*ast);
+    const auto &name = function.proto->name;
+    names.push_back(name);
+    keys.push_back(cacheKey(function));
+    callees.emplace_back();
+    ast::expr::collectCallees(*function.body, callees.back());
+
+    auto previous = definitions.find(name);
+    if (previous != definitions.end() &&
+        !sameSignature(*previous->second.proto, *function.proto)) {
+      if (interp) {
+        throw std::runtime_error(
+            "Function signature cannot change in tiered mode");
+      }
+      stale.insert(callers[name].begin(), callers[name].end());
+      changed.insert(name);
+    }
+  }
+  for (const auto &name : names) {
+    stale.erase(name);
+  }
+
+  // Recompiled callers must not call the specializations being dropped.
+  std::vector<std::string> refresh;
+  std::unordered_map<std::string, std::unique_ptr<ast::Prototype>> dropped;
+  for (const auto &[key, spec] : specializations) {
+    if (changed.count(spec.callee)) {
+      dropped[key] = std::move(state.specializations[key]);
+      state.specializations.erase(key);
+    } else if (stale.count(spec.callee) ||
+               std::find(names.begin(), names.end(), spec.callee) !=
+                   names.end()) {
+      refresh.push_back(key);
+    }
+  }
+  redefining.insert(names.begin(), names.end());
+
+  std::unordered_map<std::string, std::unique_ptr<ast::Prototype>> saved;
+  std::vector<std::unique_ptr<ast::Prototype>> protos;
+  std::vector<llvm::orc::VModuleKey> compiled;
+  std::vector<llvm::orc::VModuleKey> refreshed;
+  try {
+    for (auto &ast : functions) {
+      const auto &proto = *std::get<ast::Function>(*ast).proto;
+      auto protoIt = state.functionProtos.find(proto.name);
+      saved[proto.name] = protoIt != state.functionProtos.end()
+                              ? std::make_unique<ast::Prototype>(
+                                    *protoIt->second)
+                              : nullptr;
+      protos.push_back(std::make_unique<ast::Prototype>(proto));
+      compiled.push_back(compile(*ast, printIR));
+    }
+    for (const auto &name : stale) {
+      auto &def = definitions[name];
+      std::get<ast::Function>(*def.ast).proto =
+          std::make_unique<ast::Prototype>(*def.proto);
+      try {
+        compiled.push_back(compile(*def.ast, printIR));
+      } catch (const std::exception &e) {
+        throw std::runtime_error("redefinition breaks caller " + name + ": " +
+                                 e.what());
+      }
+    }
+    for (const auto &key : refresh) {
+      const auto &spec = specializations[key];
+      size_t i = std::find(names.begin(), names.end(), spec.callee) -
+                 names.begin();
+      if (i < names.size()) {
+        refreshed.push_back(compileSpecialization(
+            spec, *protos[i], *std::get<ast::Function>(*functions[i]).body));
+      } else {
+        const auto &def = definitions[spec.callee];
+        refreshed.push_back(compileSpecialization(
+            spec, *def.proto, *std::get<ast::Function>(*def.ast).body));
+      }
+    }
+  } catch (...) {
+    redefining.clear();
+    for (auto modHandle : compiled) {
+      unload(modHandle);
+    }
+    for (auto modHandle : refreshed) {
+      unload(modHandle);
+    }
+    for (auto &[key, proto] : dropped) {
+      state.specializations[key] = std::move(proto);
+    }
+    for (auto &[name, proto] : saved) {
+      if (proto) {
+        state.functionProtos[name] = std::move(proto);
+      } else {
+        state.functionProtos.erase(name);
+      }
+    }
+    throw;
+  }
+  redefining.clear();
+
+  // Every stub has to exist before the first body is linked, so that calls
+  // within the batch, and to functions only declared so far, bind to stubs.
+  for (const auto &name : names) {
+    jit.addStub(state.functionProtos[name]->symbolName(state));
+  }
+  for (const auto &calls : callees) {
+    for (const auto &callee : calls) {
+      auto protoIt = state.functionProtos.find(callee);
+      if (protoIt == state.functionProtos.end()) {
+        continue;
+      }
+      auto symbol = protoIt->second->symbolName(state);
+      if (!jit.getSymbolAddress(symbol)) {
+        jit.addStub(symbol);
+        undefined.insert(callee);
+      }
+    }
+  }
+
+  for (size_t i = 0; i < names.size(); ++i) {
+    jit.redirectStub(state.functionProtos[names[i]]->symbolName(state),
+                     compiled[i]);
+    undefined.erase(names[i]);
+  }
+  size_t next = names.size();
+  for (const auto &name : stale) {
+    jit.redirectStub(state.functionProtos[name]->symbolName(state),
+                     compiled[next++]);
+  }
+  for (size_t i = 0; i < refresh.size(); ++i) {
+    jit.redirectStub(state.specializations[refresh[i]]->symbolName(state),
+                     refreshed[i]);
+  }
+
+  // Only now is nothing still bound to the old bodies.
+  for (size_t i = 0; i < names.size(); ++i) {
+    const auto &name = names[i];
+    auto previous = definitions.find(name);
+    if (previous != definitions.end()) {
+      if (!previous->second.evicted) {
+        unload(previous->second.module);
+      }
+      for (const auto &callee : previous->second.callees) {
+        auto callerIt = callers.find(callee);
+        callerIt->second.erase(name);
+        if (callerIt->second.empty()) {
+          callers.erase(callerIt);
+        }
+      }
+    }
+    for (const auto &callee : callees[i]) {
+      callers[callee].insert(name);
+    }
+    definitions[name] =
+        Definition{std::move(protos[i]), std::move(functions[i]), compiled[i],
+                   std::move(callees[i]), std::move(keys[i])};
+    ++generations[name];
+  }
+  next = names.size();
+  for (const auto &name : stale) {
+    auto &def = definitions[name];
+    if (!def.evicted) {
+      unload(def.module);
+    }
+    def.module = compiled[next++];
+    def.evicted = false;
+  }
+  for (size_t i = 0; i < refresh.size(); ++i) {
+    auto &spec = specializations[refresh[i]];
+    unload(spec.module);
+    specializedSize -= spec.size;
+    spec.module = refreshed[i];
+    spec.size = irFootprints[spec.module].count;
+    specializedSize += spec.size;
+  }
+  for (const auto &[key, proto] : dropped) {
+    auto spec = specializations.find(key);
+    jit.clearStub(proto->symbolName(state));
+    unload(spec->second.module);
+    specializedSize -= spec->second.size;
+    specializations.erase(spec);
+  }
+}
+
+void *Session::nativeAddress(const std::string &name) {
+  return reinterpret_cast<void *>(
+      static_cast<intptr_t>(jit.getSymbolAddress(name)));
+}
+
+// Runs every pending expression on the eval pool and prints the results in the
+// order the expressions appeared in the source.
+void Session::runPendingExprs(std::vector<PendingExpr> &pending) {
+  // Wait on our own tasks only: the pool may be busy with other sessions.
+  std::vector<std::shared_future<void>> done;
+  for (auto &expr : pending) {
+    done.push_back(
+        options.evalPool->async([&expr] { expr.result = expr.fP(); }));
+  }
+  for (auto &task : done) {
+    task.wait();
+  }
+
+  for (auto &expr : pending) {
+    out << "Eval:\n" << expr.result << '\n';
+    if (expr.fromCache) {
+      continue;
+    }
+    if (!expr.cacheKey.empty()) {
+      cacheExpr(std::move(expr.cacheKey), expr.modHandle, expr.fP);
+    } else {
+      unload(expr.modHandle);
+    }
+  }
+  pending.clear();
+}
+
+// JIT-compiles the named cold definitions together with every cold function
+// they can reach, so the emitted code never calls back into bytecode.
+void Session::compileColdDefs(const std::vector<std::string> &roots) {
+  std::vector<std::string> order;
+  std::unordered_set<std::string> seen;
+  std::vector<std::string> work(roots);
+  while (!work.empty()) {
+    std::string name = work.back();
+    work.pop_back();
+    if (!coldDefs.count(name) || !seen.insert(name).second) {
+      continue;
+    }
+    order.push_back(name);
+    const auto &callees = interp->callees(name);
+    work.insert(work.end(), callees.begin(), callees.end());
+  }
+
+  std::vector<std::unique_ptr<ast::AstNode>> functions;
+  for (const auto &name : order) {
+    functions.push_back(std::move(coldDefs[name]));
+    coldDefs.erase(name);
+  }
+  define(std::move(functions), false);
+
+  for (const auto &name : order) {
+    interp->setNative(
+        name, nativeAddress(state.functionProtos[name]->symbolName(state)));
+  }
+}
+
+void Session::setupTiers() {
+  auto resolveNative = [this](const std::string &name)
+      -> std::optional<bytecode::NativeFunction> {
+    auto protoIt = state.functionProtos.find(name);
+    const host::Function *hostFunction =
+        options.hostFunctions ? options.hostFunctions->find(name) : nullptr;
+    if (hostFunction &&
+        (protoIt == state.functionProtos.end() || protoIt->second->isExtern)) {
+      return bytecode::NativeFunction{hostFunction->address,
+                                      hostFunction->argTypes.size(),
+                                      hostFunction->isUntyped()};
+    }
+    if (protoIt == state.functionProtos.end()) {
+      // Only the JIT generates builtins.
+      if (ast::isBuiltin(name)) {
+        return bytecode::NativeFunction{nullptr, 0, false};
+      }
+      return std::nullopt;
+    }
+    const auto &proto = *protoIt->second;
+    void *address = nativeAddress(proto.symbolName(state));
+    if (!address) {
+      return std::nullopt;
+    }
+    return bytecode::NativeFunction{address, proto.args.size(),
+                                    proto.isUntyped()};
+  };
+
+  auto tierUp = [this](const std::string &name) -> void * {
+    compileColdDefs({name});
+    return nativeAddress(state.functionProtos[name]->symbolName(state));
+  };
+
+  interp = std::make_unique<bytecode::Interpreter>(resolveNative, tierUp,
+                                                   options.tierUpThreshold);
+}
+
+// Runs a definition or top-level expression in the bytecode tier. Returns
+// false (leaving ast untouched) when it has to go through the JIT instead.
+bool Session::tryInterpret(std::unique_ptr<ast::AstNode> &ast) {
+  auto *function = std::get_if<ast::Function>(ast.get());
+  if (!function) {
+    return false;
+  }
+
+  if (isTopLevelExpr(*ast)) {
+    auto result = interp->evaluate(*function->body);
+    if (!result) {
+      return false;
+    }
+    out << "Eval:\n" << *result << '\n';
+    return true;
+  }
+
+  // A function that already has native code stays native, so that native
+  // callers see the redefinition.
+  if (definitions.count(function->proto->name) ||
+      !interp->define(*function)) {
+    return false;
+  }
+  // Later JIT codegen of callers needs the prototype, not the body.
+  const auto &name = function->proto->name;
+  state.functionProtos[name] =
+      std::make_unique<ast::Prototype>(*function->proto);
+  coldDefs[name] = std::move(ast);
+  return true;
+}
+
+void Session::run(lexer::Lexer &lexer) {
+  runItems([&]() -> std::unique_ptr<ast::AstNode> {
+    // Top-level items may be separated by semicolons.
+    while (lexer.peek() == tokens::Token{tokens::Character{';'}}) {
+      lexer.pop();
+    }
+    if (std::holds_alternative<tokens::Eof>(lexer.peek())) {
+      return nullptr;
+    }
+    return parser.parse(lexer);
+  });
+}
+
+void Session::run(std::vector<std::unique_ptr<ast::AstNode>> items) {
+  auto it = items.begin();
+  runItems([&]() -> std::unique_ptr<ast::AstNode> {
+    return it != items.end() ? std::move(*it++) : nullptr;
+  });
+}
+
+// Handles each item next returns, in order, until it returns null.
+void Session::runItems(
+    const std::function<std::unique_ptr<ast::AstNode>()> &next) {
+  evictIdle();
+
+  std::vector<PendingExpr> pending;
+  try {
+    while (auto ast = next()) {
+
+      if (isTopLevelExpr(*ast)) {
+        std::vector<std::string> callees;
+        ast::expr::collectCallees(*std::get<ast::Function>(*ast).body,
+                                  callees);
+        markUsed(callees);
+      }
+
+      if (interp) {
+        if (tryInterpret(ast)) {
+          continue;
+        }
+        // Whatever the JIT compiles must only call JIT-compiled code.
+        if (auto *function = std::get_if<ast::Function>(ast.get())) {
+          std::vector<std::string> callees;
+          ast::expr::collectCallees(*function->body, callees);
+          compileColdDefs(callees);
+        }
+      }
+
+      if (std::holds_alternative<ast::Function>(*ast) &&
+          !isTopLevelExpr(*ast)) {
+        const auto name = std::get<ast::Function>(*ast).proto->name;
+        // Resubmitting a definition unchanged leaves it as it is.
+        auto previous = definitions.find(name);
+        if (options.exprCacheSize && previous != definitions.end() &&
+            previous->second.key ==
+                cacheKey(std::get<ast::Function>(*ast))) {
+          continue;
+        }
+        // Expressions already read must still see the old body.
+        if (definitions.count(name) && !pending.empty()) {
+          runPendingExprs(pending);
+        }
+        std::vector<std::unique_ptr<ast::AstNode>> functions;
+        functions.push_back(std::move(ast));
+        define(std::move(functions), options.printIR);
+        if (interp) {
+          interp->setNative(name, nativeAddress(
+                                      state.functionProtos[name]->symbolName(
+                                          state)));
+        }
+        continue;
+      }
+
+      std::string key;
+      if (options.exprCacheSize && isTopLevelExpr(*ast)) {
+        key = cacheKey(std::get<ast::Function>(*ast));
+        if (auto *cached = findCachedExpr(key)) {
+          if (options.evalPool) {
+            pending.push_back({cached->modHandle, cached->fP, 0.0, "", true});
+          } else {
+            out << "Eval:\n" << cached->fP() << '\n';
+          }
+          continue;
+        }
+      }
+
+      // Concurrently pending and cached expressions each need their own
+      // symbol.
+      std::string exprName = "__anon_expr";
+      if ((options.evalPool || !key.empty()) && isTopLevelExpr(*ast)) {
+        exprName += "." + std::to_string(state.anonExprCount++);
+        std::get<ast::Function>(*ast).proto->name = exprName;
+      }
+
+      auto modHandle = compile(*ast, options.printIR);
+
+      auto fP = reinterpret_cast<expr_fn_t>(
+          nativeAddress(state.symbolPrefix + exprName));
+      if (fP) {
+        if (options.evalPool) {
+          pending.push_back({modHandle, fP, 0.0, std::move(key)});
+          state.functionProtos.erase(exprName);
+        } else {
+          out << "Eval:\n" << fP() << '\n';
+          if (key.empty()) {
+            unload(modHandle);
+          } else {
+            state.functionProtos.erase(exprName);
+            cacheExpr(std::move(key), modHandle, fP);
+          }
+        }
+      } else {
+        modules.push_back(modHandle);
+        if (auto *proto = std::get_if<ast::Prototype>(ast.get())) {
+          ++generations[proto->name];
+        }
+      }
+    }
+  } catch (...) {
+    for (auto &expr : pending) {
+      if (!expr.fromCache) {
+        unload(expr.modHandle);
+      }
+    }
+    throw;
+  }
+
+  if (options.evalPool) {
+    runPendingExprs(pending);
+  }
+}
+} // namespace session
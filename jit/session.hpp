@@ -0,0 +1,215 @@
+#ifndef JIT_SESSION_HPP_
+#define JIT_SESSION_HPP_
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "llvm/Support/ThreadPool.h"
+
+#include "ast.hpp"
+#include "bytecode.hpp"
+#include "host_registry.hpp"
+#include "kaleidoscope_jit.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "profiler.hpp"
+#include "remarks.hpp"
+
+namespace session {
+struct Options {
+  // Evaluate the top-level expressions of each input concurrently on this
+  // pool (which may be shared between sessions). Only evaluation runs there:
+  // a session compiles on whichever thread calls it.
+  llvm::ThreadPool *evalPool = nullptr;
+  bool tiered = false;
+  unsigned tierUpThreshold = 1000;
+  ast::FPMode fpMode = ast::FPMode::Strict;
+  bool boundsChecks = false;
+  // Print the optimized IR of everything compiled, rather than only on :ir.
+  bool printIR = false;
+  // See ast::GenState::preferVectorWidth.
+  unsigned preferVectorWidth = 0;
+  // Host functions every session can call; must outlive the session.
+  const host::Registry *hostFunctions = nullptr;
+  // Compiled top-level expressions kept loaded so that reading the same
+  // expression again just reruns it; 0 disables the cache.
+  size_t exprCacheSize = 0;
+  // Definitions and cached expressions unused for this long are unloaded,
+  // and definitions recompiled when next needed. Zero keeps everything.
+  std::chrono::seconds evictAfter{0};
+  // Codegen switches to a fresh LLVMContext after this many modules, or
+  // once what the current one uniqued comes to this many bytes, so that what
+  // contexts unique doesn't pile up over a long session. 0 disables either.
+  size_t recycleContextModules = 0;
+  size_t recycleContextBytes = 0;
+  // IR instructions that clones of definitions specialized on the constant
+  // arguments of their calls may take up in all; 0 disables specialization.
+  size_t specializationBudget = 0;
+  // Where the optimization remarks of everything compiled are written, if
+  // anywhere; must outlive the session.
+  remarks::File *remarks = nullptr;
+  // Sampling everything the JIT runs, which makes generated code keep its
+  // frame pointers; must outlive the session.
+  profiler::Profiler *profiler = nullptr;
+  std::string symbolPrefix;
+};
+
+// Everything one user of the JIT sees: its own names, prototypes and codegen
+// state. Several sessions can share a single KaleidoscopeJIT.
+class Session {
+public:
+  Session(llvm::orc::KaleidoscopeJIT &jit, const Options &options,
+          std::ostream &out);
+  // Removes everything the session added to the JIT.
+  ~Session();
+
+  // Makes every function defined or declared in library callable here.
+  void importLibrary(const Session &library);
+  void run(lexer::Lexer &lexer);
+  // Like run, for items parsed already.
+  void run(std::vector<std::unique_ptr<ast::AstNode>> items);
+  // Handles a REPL command (a line starting with ':'), returning false for
+  // anything else.
+  bool runCommand(const std::string &line);
+
+private:
+  using expr_fn_t = double (*)();
+  using clock = std::chrono::steady_clock;
+
+  // What printCode prints.
+  enum class Listing { IR, Assembly, Remarks };
+
+  // A top-level expression that has been compiled and linked but not yet run.
+  struct PendingExpr {
+    llvm::orc::VModuleKey modHandle;
+    expr_fn_t fP;
+    double result;
+    // Cached once it has run, unless empty.
+    std::string cacheKey;
+    bool fromCache = false;
+  };
+
+  // A compiled top-level expression kept for re-evaluation.
+  struct CachedExpr {
+    std::string key;
+    llvm::orc::VModuleKey modHandle;
+    expr_fn_t fP;
+    clock::time_point lastUsed;
+  };
+
+  // A top-level expression compiled on its own by :time or :bench.
+  struct TimedExpr {
+    llvm::orc::VModuleKey modHandle;
+    expr_fn_t fP;
+    clock::duration compileTime;
+  };
+
+  // A JIT-compiled named function. Callers reach it through its stub, so it
+  // can be redefined without recompiling them unless its signature changes.
+  struct Definition {
+    std::unique_ptr<ast::Prototype> proto;
+    // The function itself; its prototype is owned by the codegen state.
+    std::unique_ptr<ast::AstNode> ast;
+    llvm::orc::VModuleKey module;
+    std::vector<std::string> callees;
+    std::string key;
+    clock::time_point lastUsed = clock::now();
+    // Unloaded for being idle; module is stale and the stub has no target.
+    bool evicted = false;
+  };
+
+  // A clone of a definition specialized on some constant arguments, kept
+  // behind a stub of its own.
+  struct Specialization {
+    std::string callee;
+    ast::constants_t constants;
+    std::string name;
+    llvm::orc::VModuleKey module;
+    // IR instructions, charged against the budget.
+    size_t size;
+  };
+
+  void runItems(const std::function<std::unique_ptr<ast::AstNode>()> &next);
+  void makeModule();
+  void watchRemarks();
+  llvm::orc::VModuleKey compile(ast::AstNode &ast, bool printIR);
+  llvm::orc::VModuleKey finishModule(llvm::Function *fnIR, bool printIR);
+  void specializeCalls(const ast::Function &function);
+  llvm::orc::VModuleKey compileSpecialization(const Specialization &spec,
+                                              const ast::Prototype &proto,
+                                              ast::expr::ExprNode &body);
+  void unload(llvm::orc::VModuleKey modHandle);
+  void define(std::vector<std::unique_ptr<ast::AstNode>> functions,
+              bool printIR);
+  void runPendingExprs(std::vector<PendingExpr> &pending);
+  void setupTiers();
+  bool tryInterpret(std::unique_ptr<ast::AstNode> &ast);
+  void compileColdDefs(const std::vector<std::string> &roots);
+  void *nativeAddress(const std::string &name);
+  void printMemoryUsage(bool json);
+  void printCode(const std::string &name, Listing listing);
+  void timeExpr(const std::string &source, bool benchmark);
+  TimedExpr compileExpr(ast::AstNode &ast);
+  std::string cacheKey(const ast::Function &function) const;
+  const CachedExpr *findCachedExpr(const std::string &key);
+  void cacheExpr(std::string key, llvm::orc::VModuleKey modHandle,
+                 expr_fn_t fP);
+  std::unordered_set<std::string>
+  reachableFrom(std::vector<std::string> roots) const;
+  void markUsed(const std::vector<std::string> &roots);
+  void evictIdle();
+
+  llvm::orc::KaleidoscopeJIT &jit;
+  // The optimization passes query the target's cost model, which changes
+  // the target machine it comes from, so each session has its own rather
+  // than racing others on the JIT's.
+  std::unique_ptr<llvm::TargetMachine> targetMachine;
+  Options options;
+  std::ostream &out;
+  parser::Parser parser;
+  ast::GenState state;
+  std::vector<llvm::orc::VModuleKey> modules;
+  std::unordered_map<std::string, Definition> definitions;
+  // IR emitted for each module still loaded. The JIT frees the IR itself once
+  // it is compiled, so this is what it took rather than what it holds.
+  std::unordered_map<llvm::orc::VModuleKey, ast::Footprint> irFootprints;
+  // What the current context uniqued for the modules generated in it, by
+  // address, with the estimated bytes it all takes.
+  std::unordered_set<const void *> contextUniqued;
+  size_t contextBytes = 0;
+  size_t contextModules = 0;
+  // Functions only declared so far that definitions call through a stub
+  // with nothing behind it yet.
+  std::unordered_set<std::string> undefined;
+  // Reverse call graph of the definitions: callee -> its callers.
+  std::unordered_map<std::string, std::unordered_set<std::string>> callers;
+  // Bumped whenever a name is bound to new code, which changes the cache key
+  // of everything calling it.
+  std::unordered_map<std::string, uint64_t> generations;
+  // Most recently used first.
+  std::list<CachedExpr> exprCache;
+  std::unordered_map<std::string, std::list<CachedExpr>::iterator>
+      exprCacheIndex;
+  // By ast::specializationKey.
+  std::unordered_map<std::string, Specialization> specializations;
+  size_t specializedSize = 0;
+  size_t specializationCount = 0;
+  // Functions being redefined, which must not be specialized on the
+  // definitions about to be replaced.
+  std::unordered_set<std::string> redefining;
+
+  // Bytecode tier: definitions that have only been compiled to bytecode so
+  // far keep their AST here until they get hot enough to be JIT-compiled.
+  std::unique_ptr<bytecode::Interpreter> interp;
+  std::unordered_map<std::string, std::unique_ptr<ast::AstNode>> coldDefs;
+};
+} // namespace session
+
+#endif // !JIT_SESSION_HPP_
@@ -0,0 +1,137 @@
+#include "watch.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <vector>
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "source_file.hpp"
+
+namespace {
+volatile std::sig_atomic_t stopRequested = 0;
+
+void requestStop(int) { stopRequested = 1; }
+
+// Brings session up to date with what is at path now.
+void reload(const std::string &path, source::File &file,
+            session::Session &session) {
+  std::ifstream input(path, std::ios::binary);
+  if (!input) {
+    std::cerr << "unable to open " << path << '\n';
+    return;
+  }
+  std::ostringstream text;
+  text << input.rdbuf();
+  std::vector<std::unique_ptr<ast::AstNode>> items;
+  try {
+    items = file.update(text.str());
+  } catch (const std::exception &e) {
+    std::cerr << path << ": " << e.what() << '\n';
+    return;
+  }
+  // One at a time, so that we know which ran.
+  for (size_t i = 0; i < items.size(); ++i) {
+    try {
+      std::vector<std::unique_ptr<ast::AstNode>> item;
+      item.push_back(std::move(items[i]));
+      session.run(std::move(item));
+    } catch (const std::exception &e) {
+      // Later items may depend on this one; all of them are run again on
+      // the next save.
+      file.reject(i);
+      std::cerr << path << ": " << e.what() << '\n';
+      if (i + 1 < items.size()) {
+        std::cerr << path << ": " << items.size() - i - 1
+                  << " later items not run\n";
+      }
+      return;
+    }
+  }
+}
+} // namespace
+
+namespace watch {
+int watch(const std::vector<std::string> &paths, session::Session &session) {
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) {
+    std::cerr << "unable to watch files: " << std::strerror(errno) << '\n';
+    return 1;
+  }
+
+  // Editors often save by renaming a new file over the old one, so the
+  // directories are watched rather than the files themselves.
+  std::vector<source::File> files(paths.size());
+  std::map<std::pair<int, std::string>, size_t> watched;
+  for (size_t i = 0; i < paths.size(); ++i) {
+    auto slash = paths[i].rfind('/');
+    std::string dir =
+        slash == std::string::npos ? "." : paths[i].substr(0, slash + 1);
+    int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (wd < 0) {
+      std::cerr << "unable to watch " << dir << ": " << std::strerror(errno)
+                << '\n';
+      close(fd);
+      return 1;
+    }
+    watched[{wd, paths[i].substr(slash + 1)}] = i;
+    reload(paths[i], files[i], session);
+  }
+
+  struct sigaction action = {};
+  action.sa_handler = requestStop;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, nullptr);
+  sigaction(SIGTERM, &action, nullptr);
+
+  alignas(inotify_event) char buffer[sizeof(inotify_event) + NAME_MAX + 1];
+  // Polling with a timeout notices a stop whichever thread got the signal.
+  while (!stopRequested) {
+    pollfd events{fd, POLLIN, 0};
+    int ready = poll(&events, 1, 100);
+    if (ready < 0 && errno != EINTR) {
+      std::cerr << "unable to watch files: " << std::strerror(errno) << '\n';
+      close(fd);
+      return 1;
+    }
+    if (ready <= 0) {
+      continue;
+    }
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      std::cerr << "unable to watch files: " << std::strerror(errno) << '\n';
+      close(fd);
+      return 1;
+    }
+
+    // In command line order, however the events came.
+    std::set<size_t> changed;
+    for (char *next = buffer; next < buffer + n;) {
+      auto *event = reinterpret_cast<inotify_event *>(next);
+      if (event->len) {
+        auto it = watched.find({event->wd, event->name});
+        if (it != watched.end()) {
+          changed.insert(it->second);
+        }
+      }
+      next += sizeof(inotify_event) + event->len;
+    }
+    for (size_t i : changed) {
+      reload(paths[i], files[i], session);
+    }
+  }
+  close(fd);
+  return 0;
+}
+} // namespace watch
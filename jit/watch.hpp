@@ -0,0 +1,16 @@
+#ifndef JIT_WATCH_HPP_
+#define JIT_WATCH_HPP_
+
+#include <string>
+#include <vector>
+
+#include "session.hpp"
+
+namespace watch {
+// Runs the files at paths in session, then runs the items that changed in a
+// file whenever it is saved again. Returns 0 on SIGINT or SIGTERM, or 1 if
+// watching fails.
+int watch(const std::vector<std::string> &paths, session::Session &session);
+} // namespace watch
+
+#endif // !JIT_WATCH_HPP_
@@ -0,0 +1,99 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+
+#include "bytecode.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+
+namespace {
+std::unique_ptr<ast::AstNode> parseItem(const std::string &input) {
+  std::stringstream ss;
+  ss << input;
+  lexer::Lexer lexer(ss);
+  parser::Parser parser;
+  return parser.parse(lexer);
+}
+
+std::optional<bytecode::NativeFunction> noNatives(const std::string &) {
+  return std::nullopt;
+}
+
+double square(double x) { return x * x; }
+} // namespace
+
+TEST(Bytecode, EvaluatesArithmetic) {
+  bytecode::Interpreter interp(noNatives, nullptr, 0);
+  auto expr = parseItem("1 + 2 * 3 - 4");
+  auto result = interp.evaluate(*std::get<ast::Function>(*expr).body);
+  ASSERT_TRUE(result);
+  ASSERT_EQ(*result, 3);
+}
+
+TEST(Bytecode, CallsDefinedFunctions) {
+  bytecode::Interpreter interp(noNatives, nullptr, 0);
+  auto sq = parseItem("def sq(x) x * x");
+  ASSERT_TRUE(interp.define(std::get<ast::Function>(*sq)));
+  auto f = parseItem("def f(a, b) sq(a) + sq(b) < 30");
+  ASSERT_TRUE(interp.define(std::get<ast::Function>(*f)));
+
+  auto expr = parseItem("f(3, 4) + sq(f(1, 2) + 2)");
+  auto result = interp.evaluate(*std::get<ast::Function>(*expr).body);
+  ASSERT_TRUE(result);
+  ASSERT_EQ(*result, 10);
+}
+
+TEST(Bytecode, CallsNativeFunctions) {
+  bytecode::Interpreter interp(
+      [](const std::string &name) -> std::optional<bytecode::NativeFunction> {
+        if (name == "square") {
+          return bytecode::NativeFunction{reinterpret_cast<void *>(&square),
+                                          1};
+        }
+        return std::nullopt;
+      },
+      nullptr, 0);
+  auto expr = parseItem("square(3) + 1");
+  auto result = interp.evaluate(*std::get<ast::Function>(*expr).body);
+  ASSERT_TRUE(result);
+  ASSERT_EQ(*result, 10);
+}
+
+TEST(Bytecode, TiersUpHotFunctions) {
+  int tierUps = 0;
+  bytecode::Interpreter interp(
+      noNatives,
+      [&](const std::string &name) -> void * {
+        ++tierUps;
+        return reinterpret_cast<void *>(&square);
+      },
+      2);
+  auto sq = parseItem("def sq(x) x * x");
+  ASSERT_TRUE(interp.define(std::get<ast::Function>(*sq)));
+
+  auto expr = parseItem("sq(2) + sq(3) + sq(4)");
+  auto result = interp.evaluate(*std::get<ast::Function>(*expr).body);
+  ASSERT_TRUE(result);
+  ASSERT_EQ(*result, 29);
+  ASSERT_EQ(tierUps, 1);
+  ASSERT_FALSE(interp.isInterpreted("sq"));
+}
+
+TEST(Bytecode, EvaluatesConditionals) {
+  bytecode::Interpreter interp(noNatives, nullptr, 0);
+  auto fib = parseItem(
+      "def fib(n) if n < 2 then n else fib(n - 1) + fib(n - 2)");
+  ASSERT_TRUE(interp.define(std::get<ast::Function>(*fib)));
+
+  auto expr = parseItem("fib(10) + (if 0 then 100 else 1)");
+  auto result = interp.evaluate(*std::get<ast::Function>(*expr).body);
+  ASSERT_TRUE(result);
+  ASSERT_EQ(*result, 56);
+}
+
+TEST(Bytecode, RejectsUnknownFunctions) {
+  bytecode::Interpreter interp(noNatives, nullptr, 0);
+  auto expr = parseItem("missing(1)");
+  ASSERT_THROW(interp.evaluate(*std::get<ast::Function>(*expr).body),
+               std::runtime_error);
+}
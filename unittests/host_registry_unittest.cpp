@@ -0,0 +1,91 @@
+#include <gtest/gtest.h>
+
+#include <sstream>
+
+#include "llvm/Support/TargetSelect.h"
+
+#include "host_registry.hpp"
+#include "lexer.hpp"
+#include "session.hpp"
+
+namespace {
+double clampUnit(double x) { return x < 0 ? 0 : x > 1 ? 1 : x; }
+
+host::Function clampFunction(bool withIR) {
+  host::Function function{"clampunit",
+                          reinterpret_cast<void *>(&clampUnit),
+                          {ast::Type::F64},
+                          ast::Type::F64,
+                          true,
+                          true};
+  if (withIR) {
+    function.ir = "define double @clampunit(double %x) {\n"
+                  "  %lo = fcmp olt double %x, 0.0\n"
+                  "  %a = select i1 %lo, double 0.0, double %x\n"
+                  "  %hi = fcmp ogt double %a, 1.0\n"
+                  "  %r = select i1 %hi, double 1.0, double %a\n"
+                  "  ret double %r\n"
+                  "}\n";
+  }
+  return function;
+}
+
+// What a session calling functions from registry prints for each line.
+std::vector<std::string> runLines(const host::Registry &registry,
+                                  const std::vector<std::string> &lines) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+  llvm::orc::KaleidoscopeJIT jit;
+  std::ostringstream out;
+  session::Options options;
+  options.hostFunctions = &registry;
+  session::Session session(jit, options, out);
+
+  std::vector<std::string> printed;
+  for (const auto &line : lines) {
+    out.str("");
+    if (!session.runCommand(line)) {
+      std::stringstream input(line);
+      lexer::Lexer lexer(input);
+      session.run(lexer);
+    }
+    printed.push_back(out.str());
+  }
+  return printed;
+}
+} // namespace
+
+TEST(HostRegistry, FindsWhatWasAdded) {
+  host::Registry registry;
+  registry.add(clampFunction(false));
+  const auto *found = registry.find("clampunit");
+  ASSERT_NE(found, nullptr);
+  ASSERT_EQ(found->address, reinterpret_cast<void *>(&clampUnit));
+  ASSERT_TRUE(found->isUntyped());
+  ASSERT_EQ(registry.find("clamp"), nullptr);
+  ASSERT_EQ(registry.functions().size(), 1);
+
+  host::Function noAddress{"nowhere"};
+  ASSERT_THROW(registry.add(noAddress), std::runtime_error);
+}
+
+TEST(HostRegistry, CallsNeedNoExtern) {
+  host::Registry registry;
+  registry.add(clampFunction(false));
+  auto printed = runLines(registry, {"def f(x) clampunit(x) * 2",
+                                     "f(0 - 3) + f(0.25) + f(7)", ":ir f"});
+  ASSERT_EQ(printed[1], "Eval:\n2.5\n");
+  // Without an IR body the host's own copy is called.
+  ASSERT_NE(printed[2].find("call double @clampunit"), std::string::npos);
+}
+
+TEST(HostRegistry, IRBodiesAreInlined) {
+  host::Registry registry;
+  registry.add(clampFunction(true));
+  auto printed = runLines(registry, {"def f(x) clampunit(x) * 2",
+                                     "f(0 - 3) + f(0.25) + f(7)", ":ir f"});
+  ASSERT_EQ(printed[1], "Eval:\n2.5\n");
+  ASSERT_EQ(printed[2].find("call"), std::string::npos);
+  ASSERT_NE(printed[2].find("select"), std::string::npos);
+}
@@ -32,3 +32,63 @@ TEST(Lexer, ParsesAllIdentifiersCorrectly) {
   ASSERT_EQ(lexer.pop(), tokens::Token(tokens::Number(12.34)));
   ASSERT_EQ(lexer.pop(), tokens::Token(tokens::Character('(')));
 }
+
+TEST(Lexer, IdentifiersMayContainDigits) {
+  std::string testInput{"i64 x2y 3"};
+  std::stringstream ss;
+  ss << testInput;
+  lexer::Lexer lexer(ss);
+
+  ASSERT_EQ(lexer.pop(), tokens::Token(tokens::Identifier("i64")));
+  ASSERT_EQ(lexer.pop(), tokens::Token(tokens::Identifier("x2y")));
+  ASSERT_EQ(lexer.pop(), tokens::Token(tokens::Number(3)));
+}
+
+TEST(Lexer, ParsesControlFlowKeywords) {
+  std::string testInput{"if then else for in iffy"};
+  std::stringstream ss;
+  ss << testInput;
+  lexer::Lexer lexer(ss);
+
+  ASSERT_TRUE(std::holds_alternative<tokens::If>(lexer.pop()));
+  ASSERT_TRUE(std::holds_alternative<tokens::Then>(lexer.pop()));
+  ASSERT_TRUE(std::holds_alternative<tokens::Else>(lexer.pop()));
+  ASSERT_TRUE(std::holds_alternative<tokens::For>(lexer.pop()));
+  ASSERT_TRUE(std::holds_alternative<tokens::In>(lexer.pop()));
+  ASSERT_EQ(lexer.pop(), tokens::Token(tokens::Identifier("iffy")));
+}
+
+TEST(Lexer, OffsetsPointAtTokens) {
+  std::stringstream ss;
+  ss << "def f(x)\n  # comment\n  x1;";
+  lexer::Lexer lexer(ss);
+
+  ASSERT_EQ(lexer.offset(), 0);
+  lexer.pop();
+  ASSERT_EQ(lexer.offset(), 4);
+  for (int i = 0; i < 4; ++i) {
+    lexer.pop();
+  }
+  ASSERT_EQ(lexer.offset(), 23);
+  lexer.pop();
+  ASSERT_EQ(lexer.offset(), 25);
+  lexer.pop();
+  ASSERT_EQ(lexer.offset(), lexer::Lexer::npos);
+}
+
+TEST(Lexer, LocationsPointAtTokens) {
+  std::stringstream ss;
+  ss << "def f(x)\n  # comment\n  x1;";
+  lexer::Lexer lexer(ss);
+
+  lexer.pop();
+  ASSERT_EQ(lexer.lastLocation().line, 1);
+  ASSERT_EQ(lexer.lastLocation().column, 1);
+  lexer.pop();
+  ASSERT_EQ(lexer.lastLocation().column, 5);
+  for (int i = 0; i < 4; ++i) {
+    lexer.pop();
+  }
+  ASSERT_EQ(lexer.lastLocation().line, 3);
+  ASSERT_EQ(lexer.lastLocation().column, 3);
+}
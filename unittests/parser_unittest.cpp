@@ -112,3 +112,181 @@ TEST(Parser, ExternParsingWorks) {
   ASSERT_EQ(function.name, "sin");
   ASSERT_EQ(function.args[0], "x");
 }
+
+TEST(Parser, TypedPrototypeParsingWorks) {
+  std::string input{"scale(n: i64, x: f32, flag: bool, y): f32"};
+  std::stringstream ss;
+  ss << input;
+  lexer::Lexer lexer(ss);
+
+  parser::Parser parser;
+  auto proto = parser.parsePrototype(lexer);
+
+  ASSERT_EQ(proto->name, "scale");
+  std::vector<ast::Type> types{ast::Type::I64, ast::Type::F32,
+                               ast::Type::Bool, ast::Type::F64};
+  for (size_t i = 0; i < types.size(); ++i) {
+    ASSERT_EQ(proto->argTypes[i], types[i]);
+  }
+  ASSERT_EQ(proto->retType, ast::Type::F32);
+  ASSERT_FALSE(proto->isUntyped());
+}
+
+TEST(Parser, FPModeParsingWorks) {
+  std::string input{"def fast dot(a, b, c, d) a * b + c * d"};
+  std::stringstream ss;
+  ss << input;
+  lexer::Lexer lexer(ss);
+
+  parser::Parser parser;
+  auto function = std::move(std::get<ast::Function>(*parser.parse(lexer)));
+  ASSERT_EQ(function.proto->name, "dot");
+  ASSERT_EQ(function.proto->fpMode, ast::FPMode::Fast);
+  ASSERT_EQ(function.proto->args.size(), 4);
+}
+
+TEST(Parser, IfParsingWorks) {
+  std::string input{"if x < 2 then x else 1 + 2"};
+  std::stringstream ss;
+  ss << input;
+  lexer::Lexer lexer(ss);
+
+  parser::Parser parser;
+  auto expr = parser.parseExpression(lexer);
+
+  const auto &ifExpr = std::get<ast::expr::If>(*expr);
+  ASSERT_EQ(std::get<ast::expr::Binary>(*ifExpr.cond).op, '<');
+  ASSERT_EQ(std::get<ast::expr::Variable>(*ifExpr.then).name, "x");
+  ASSERT_EQ(std::get<ast::expr::Binary>(*ifExpr.otherwise).op, '+');
+}
+
+TEST(Parser, ForParsingWorks) {
+  std::string input{"for i: i64 = 0, i < n, 2 in f(i)"};
+  std::stringstream ss;
+  ss << input;
+  lexer::Lexer lexer(ss);
+
+  parser::Parser parser;
+  auto expr = parser.parseExpression(lexer);
+
+  const auto &forExpr = std::get<ast::expr::For>(*expr);
+  ASSERT_EQ(forExpr.varName, "i");
+  ASSERT_EQ(forExpr.varType, ast::Type::I64);
+  ASSERT_EQ(std::get<ast::expr::Number>(*forExpr.start).val, 0);
+  ASSERT_EQ(std::get<ast::expr::Binary>(*forExpr.cond).op, '<');
+  ASSERT_EQ(std::get<ast::expr::Number>(*forExpr.step).val, 2);
+  ASSERT_EQ(std::get<ast::expr::Call>(*forExpr.body).callee, "f");
+}
+
+TEST(Parser, BufferParsingWorks) {
+  std::string input{"def scale(xs: f64[], k) xs[i + 1] = xs[i] * k"};
+  std::stringstream ss;
+  ss << input;
+  lexer::Lexer lexer(ss);
+
+  parser::Parser parser;
+  auto function = std::move(std::get<ast::Function>(*parser.parse(lexer)));
+  ASSERT_EQ(function.proto->argTypes[0], ast::Type::F64Buffer);
+  ASSERT_EQ(function.proto->argTypes[1], ast::Type::F64);
+
+  const auto &store = std::get<ast::expr::Index>(*function.body);
+  ASSERT_EQ(store.buffer, "xs");
+  ASSERT_EQ(std::get<ast::expr::Binary>(*store.index).op, '+');
+  const auto &value = std::get<ast::expr::Binary>(*store.value);
+  ASSERT_EQ(std::get<ast::expr::Index>(*value.lhs).buffer, "xs");
+  ASSERT_FALSE(std::get<ast::expr::Index>(*value.lhs).value);
+}
+
+TEST(Parser, VectorTypesParse) {
+  std::string input{"def dot(a: f64x4, b: f64x4): f64 hsum(a * b)"};
+  std::stringstream ss;
+  ss << input;
+  lexer::Lexer lexer(ss);
+
+  parser::Parser parser;
+  auto function = std::move(std::get<ast::Function>(*parser.parse(lexer)));
+  ASSERT_EQ(function.proto->argTypes[0], ast::Type(ast::Type::F64, 4));
+  ASSERT_EQ(function.proto->retType, ast::Type::F64);
+  ASSERT_EQ(std::get<ast::expr::Call>(*function.body).callee, "hsum");
+
+  ASSERT_EQ(ast::Type::fromName("f32x8"), ast::Type(ast::Type::F32, 8));
+  ASSERT_NE(ast::Type::fromName("f32x8"), ast::Type::fromName("f32x4"));
+  ASSERT_THROW(ast::Type::fromName("f64x3"), std::runtime_error);
+  ASSERT_THROW(ast::Type::fromName("f64x"), std::runtime_error);
+  ASSERT_TRUE(ast::isBuiltin("i64x2"));
+  ASSERT_FALSE(ast::isBuiltin("f64"));
+}
+
+TEST(Parser, NodesKeepTheirLocations) {
+  std::stringstream ss;
+  ss << "def f(x)\n  g(x) * 2";
+  lexer::Lexer lexer(ss);
+
+  parser::Parser parser;
+  auto function = std::move(std::get<ast::Function>(*parser.parse(lexer)));
+  ASSERT_EQ(function.proto->location.line, 1);
+  ASSERT_EQ(function.proto->location.column, 5);
+  const auto &product = std::get<ast::expr::Binary>(*function.body);
+  ASSERT_EQ(product.location.line, 2);
+  ASSERT_EQ(product.location.column, 8);
+  const auto &call = std::get<ast::expr::Call>(*product.lhs);
+  ASSERT_EQ(call.location.column, 3);
+  ASSERT_EQ(std::get<ast::expr::Variable>(*call.args[0]).location.column, 5);
+}
+
+TEST(Parser, FingerprintsMatchStructure) {
+  auto fingerprint = [](const std::string &input) {
+    std::stringstream ss;
+    ss << input;
+    lexer::Lexer lexer(ss);
+    parser::Parser parser;
+    std::string key;
+    ast::expr::fingerprint(*parser.parseExpression(lexer), key);
+    return key;
+  };
+
+  ASSERT_EQ(fingerprint("f(x, 2) + 1"), fingerprint("f(x,2)+1"));
+  ASSERT_NE(fingerprint("f(x, 2) + 1"), fingerprint("f(x, 2) - 1"));
+  ASSERT_NE(fingerprint("f(x, 2) + 1"), fingerprint("f(x) + 1"));
+  ASSERT_NE(fingerprint("ab(c)"), fingerprint("a(bc)"));
+  ASSERT_NE(fingerprint("for i = 0, i < 3 in 1"),
+            fingerprint("for i: i64 = 0, i < 3 in 1"));
+}
+
+TEST(Parser, NestedCallParsingWorks) {
+  std::string input{"f((1), g(2) * 3, h())"};
+  std::stringstream ss;
+  ss << input;
+  lexer::Lexer lexer(ss);
+
+  parser::Parser parser;
+  auto expr = parser.parseExpression(lexer);
+
+  const auto &call = std::get<ast::expr::Call>(*expr);
+  ASSERT_EQ(call.args.size(), 3);
+  ASSERT_EQ(std::get<ast::expr::Number>(*call.args[0]).val, 1);
+  const auto &product = std::get<ast::expr::Binary>(*call.args[1]);
+  ASSERT_EQ(std::get<ast::expr::Call>(*product.lhs).callee, "g");
+  ASSERT_TRUE(std::get<ast::expr::Call>(*call.args[2]).args.empty());
+}
+
+TEST(Parser, DeepExpressionParsingWorks) {
+  // Far deeper than recursive descent could go on a default stack.
+  constexpr int depth = 100000;
+  std::string input(depth, '(');
+  input += "x";
+  input.append(depth, ')');
+  for (int i = 0; i < depth; ++i) {
+    input += " + x";
+  }
+  std::stringstream ss;
+  ss << input;
+  lexer::Lexer lexer(ss);
+
+  parser::Parser parser;
+  auto expr = parser.parseExpression(lexer);
+
+  ast::Footprint footprint;
+  ast::expr::measure(*expr, footprint);
+  ASSERT_EQ(footprint.count, 2 * depth + 1);
+}
@@ -0,0 +1,60 @@
+#include <gtest/gtest.h>
+
+#include <memory>
+#include <regex>
+#include <sstream>
+
+#include "llvm/Support/TargetSelect.h"
+
+#include "lexer.hpp"
+#include "profiler.hpp"
+#include "session.hpp"
+
+TEST(Profiler, TopLevelExpressionsShareAName) {
+  ASSERT_EQ(profiler::functionName("__anon_expr"), "__anon_expr");
+  ASSERT_EQ(profiler::functionName("__anon_expr.12"), "__anon_expr");
+  // Sessions stay apart.
+  ASSERT_EQ(profiler::functionName("s3.__anon_expr.7"), "s3.__anon_expr");
+  ASSERT_EQ(profiler::functionName("s3.fib"), "s3.fib");
+  ASSERT_EQ(profiler::functionName("fib.spec2"), "fib.spec2");
+}
+
+TEST(Profiler, WritesFoldedStacks) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+  llvm::orc::KaleidoscopeJIT jit;
+  std::unique_ptr<profiler::Profiler> profiler;
+  try {
+    profiler = std::make_unique<profiler::Profiler>();
+  } catch (const std::runtime_error &e) {
+    GTEST_SKIP() << e.what();
+  }
+  jit.addEventListener(*profiler);
+
+  std::ostringstream out;
+  session::Options options;
+  options.profiler = profiler.get();
+  {
+    session::Session session(jit, options, out);
+    std::stringstream input(
+        "def step(x) x * 0.5 + 1;"
+        "def spin(n) for i = 0, i < n in step(i);"
+        "def work(n) spin(n) + 1;"
+        "work(100000000)");
+    lexer::Lexer lexer(input);
+    session.run(lexer);
+  }
+
+  std::ostringstream folded;
+  profiler->writeFolded(folded);
+  // One stack per line, outermost function first, then its count.
+  std::regex line("[^ ;]+(;[^ ;]+)* [1-9][0-9]*");
+  std::string text;
+  bool sawWork = false;
+  for (std::istringstream lines(folded.str()); std::getline(lines, text);) {
+    ASSERT_TRUE(std::regex_match(text, line)) << text;
+    sawWork |= text.rfind("__anon_expr;work;spin", 0) == 0;
+  }
+  ASSERT_TRUE(sawWork) << folded.str();
+}
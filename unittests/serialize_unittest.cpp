@@ -0,0 +1,98 @@
+#include <gtest/gtest.h>
+
+#include <sstream>
+#include <vector>
+
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "serialize.hpp"
+
+namespace {
+std::vector<std::unique_ptr<ast::AstNode>>
+parseItems(const std::string &source) {
+  std::stringstream ss(source);
+  lexer::Lexer lexer(ss);
+  parser::Parser parser;
+  std::vector<std::unique_ptr<ast::AstNode>> items;
+  while (!std::holds_alternative<tokens::Eof>(lexer.peek())) {
+    items.push_back(parser.parse(lexer));
+    if (lexer.peek() == tokens::Token{tokens::Character{';'}}) {
+      lexer.pop();
+    }
+  }
+  return items;
+}
+} // namespace
+
+TEST(Serialize, ItemsRoundTrip) {
+  auto items = parseItems(
+      "extern sin(x);\n"
+      "def fast scale(xs: f64[], k, v: f64x4): f64x4\n"
+      "  for i: i64 = 0, i < len(xs) in xs[i] = if k < 1 then sin(k) else "
+      "xs[i] * k;\n"
+      "scale(xs, 2.5, 1)\n");
+
+  auto describe = [](const ast::AstNode &item) {
+    std::string key;
+    const ast::Prototype *proto = std::get_if<ast::Prototype>(&item);
+    if (!proto) {
+      const auto &function = std::get<ast::Function>(item);
+      proto = function.proto.get();
+      ast::expr::fingerprint(*function.body, key);
+    }
+    proto->fingerprint(key);
+    return proto->name + (proto->isExtern ? " extern " : " ") +
+           std::to_string(proto->fpMode ? static_cast<int>(*proto->fpMode)
+                                        : -1) +
+           ' ' + key;
+  };
+
+  std::string encoded = serialize::encode(items);
+  ASSERT_TRUE(serialize::isEncoded(encoded));
+  auto decoded = serialize::decode(encoded);
+  ASSERT_EQ(decoded.size(), items.size());
+  for (size_t i = 0; i < items.size(); ++i) {
+    ASSERT_EQ(describe(*decoded[i]), describe(*items[i]));
+  }
+  const auto &scale = std::get<ast::Function>(*decoded[1]);
+  ASSERT_EQ(scale.proto->location.line, 2);
+  ASSERT_EQ(scale.proto->location.column, 10);
+  const auto &loop = std::get<ast::expr::For>(*scale.body);
+  ASSERT_EQ(loop.location.line, 3);
+  ASSERT_EQ(loop.location.column, 3);
+}
+
+TEST(Serialize, OtherFilesAreRejected) {
+  std::string encoded = serialize::encode(parseItems("def f(x) x + 1"));
+  ASSERT_THROW(serialize::decode(encoded.substr(0, encoded.size() - 1)),
+               std::runtime_error);
+  ASSERT_THROW(serialize::decode(encoded + '\0'), std::runtime_error);
+  std::string otherVersion = encoded;
+  otherVersion[sizeof(serialize::magic)] ^= 1;
+  ASSERT_THROW(serialize::decode(otherVersion), std::runtime_error);
+  ASSERT_FALSE(serialize::isEncoded("def f(x) x"));
+}
+
+TEST(Serialize, CorruptItemsAreRejected) {
+  // The file ends with the body's only node: its tag, line, column and the
+  // index of x among the names f and x.
+  std::string body = serialize::encode(parseItems("def f(x) x"));
+  ASSERT_EQ(serialize::decode(body).size(), 1);
+  std::string badName = body;
+  badName.back() = 2;
+  ASSERT_THROW(serialize::decode(badName), std::runtime_error);
+  std::string badNode = body;
+  badNode[badNode.size() - 4] = 0x7f;
+  ASSERT_THROW(serialize::decode(badNode), std::runtime_error);
+
+  // An extern ends with its return type's kind and lanes, its fast-math
+  // mode, line and column.
+  std::string proto = serialize::encode(parseItems("extern f(x: i64): i64"));
+  ASSERT_EQ(serialize::decode(proto).size(), 1);
+  std::string badType = proto;
+  badType[badType.size() - 5] = 0x7f;
+  ASSERT_THROW(serialize::decode(badType), std::runtime_error);
+  std::string badLanes = proto;
+  badLanes[badLanes.size() - 4] = 3;
+  ASSERT_THROW(serialize::decode(badLanes), std::runtime_error);
+}
@@ -0,0 +1,154 @@
+#include <gtest/gtest.h>
+
+#include <sstream>
+#include <thread>
+
+#include "llvm/Support/TargetSelect.h"
+
+#include "lexer.hpp"
+#include "session.hpp"
+
+namespace {
+class SessionTest : public ::testing::Test {
+protected:
+  static void SetUpTestSuite() {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    llvm::InitializeNativeTargetAsmParser();
+  }
+
+  // What the session prints for source.
+  std::string run(session::Session &session, const std::string &source) {
+    std::stringstream input(source);
+    lexer::Lexer lexer(input);
+    out.str("");
+    session.run(lexer);
+    return out.str();
+  }
+
+  llvm::orc::KaleidoscopeJIT jit;
+  std::ostringstream out;
+};
+} // namespace
+
+TEST_F(SessionTest, RedefinitionReplacesTheBody) {
+  session::Session session(jit, {}, out);
+  ASSERT_EQ(run(session, "def f(x) x + 1; f(1)"), "Eval:\n2\n");
+  ASSERT_EQ(run(session, "def f(x) x * 10; f(1)"), "Eval:\n10\n");
+}
+
+TEST_F(SessionTest, CallersSeeRedefinitions) {
+  session::Session session(jit, {}, out);
+  ASSERT_EQ(run(session, "def f(x) x + 1; def g(x) f(x) * 2; g(1)"),
+            "Eval:\n4\n");
+  ASSERT_EQ(run(session, "def f(x) x + 2; g(1)"), "Eval:\n6\n");
+  // A new signature recompiles the callers.
+  ASSERT_EQ(run(session, "def f(x: i64): i64 x + 3; g(1)"), "Eval:\n8\n");
+}
+
+TEST_F(SessionTest, CallsToUndefinedFunctionsAreRefused) {
+  session::Session session(jit, {}, out);
+  run(session, "extern h(x); def k(x) h(x) + 1");
+  try {
+    run(session, "k(1)");
+    FAIL() << "k(1) ran";
+  } catch (const std::runtime_error &e) {
+    ASSERT_STREQ(e.what(), "undefined function h");
+  }
+  ASSERT_EQ(run(session, "def h(x) x * 3; k(1)"), "Eval:\n4\n");
+}
+
+TEST_F(SessionTest, DeeplyNestedCallsAreRefused) {
+  session::Session session(jit, {}, out);
+  run(session, "def f(x) x + 1");
+  auto nested = [](unsigned depth) {
+    std::string source;
+    for (unsigned i = 0; i < depth; ++i) {
+      source += "f(";
+    }
+    source += "0";
+    source.append(depth, ')');
+    return source;
+  };
+  ASSERT_EQ(run(session, nested(ast::maxCodegenNesting)), "Eval:\n2000\n");
+  ASSERT_THROW(run(session, nested(100000)), std::runtime_error);
+  // Nothing is left counted from the expression refused.
+  ASSERT_EQ(run(session, nested(ast::maxCodegenNesting)), "Eval:\n2000\n");
+}
+
+TEST_F(SessionTest, BenchmarkCountsMustBeWholeAndInRange) {
+  session::Session session(jit, {}, out);
+  for (const char *count : {"0", "0.5", "1000000000000"}) {
+    ASSERT_THROW(session.runCommand(std::string(":bench 1 ") + count),
+                 std::runtime_error);
+  }
+  out.str("");
+  ASSERT_TRUE(session.runCommand(":bench 1 10"));
+  ASSERT_NE(out.str().find(" calls in "), std::string::npos);
+}
+
+TEST_F(SessionTest, IdleDefinitionsAreEvictedAndRecompiled) {
+  session::Options options;
+  options.evictAfter = std::chrono::seconds(1);
+  options.specializationBudget = 4096;
+  session::Session session(jit, options, out);
+  auto symbols = [&] {
+    out.str("");
+    session.runCommand(":mem json");
+    std::string text = out.str();
+    std::string field = "\"symbols\":{\"count\":";
+    return std::stoul(text.substr(text.find(field) + field.size()));
+  };
+
+  run(session, "def p(x, n) for i = 0, i < n in x * i; "
+               "def q(x) p(x, 3) + 1");
+  ASSERT_EQ(run(session, "q(2)"), "Eval:\n1\n");
+  // p, q, the expression and the copy of p with n fixed to 3.
+  ASSERT_EQ(symbols(), 4u);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  run(session, "0");
+  ASSERT_EQ(symbols(), 3u);
+  ASSERT_EQ(run(session, "q(2)"), "Eval:\n1\n");
+  ASSERT_EQ(symbols(), 4u);
+}
+
+TEST_F(SessionTest, SessionsCompileAtOnce) {
+  // As under --serve: sessions on the shared JIT, each on its own thread.
+  constexpr int numSessions = 2, numDefinitions = 20;
+  std::vector<std::string> printed(numSessions);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < numSessions; ++i) {
+    threads.emplace_back([&, i] {
+      session::Options options;
+      options.symbolPrefix = "s" + std::to_string(i + 1) + ".";
+      std::ostringstream sessionOut;
+      session::Session session(jit, options, sessionOut);
+      try {
+        for (int k = 0; k < numDefinitions; ++k) {
+          // Loops, so the vectorizer and unroller consult the target.
+          std::stringstream input(
+              "def f" + std::to_string(k) +
+              "(x, n) for i = 0, i < n in x * i; f" + std::to_string(k) +
+              "(2, 100) + " + std::to_string(k));
+          lexer::Lexer lexer(input);
+          session.run(lexer);
+        }
+      } catch (const std::exception &e) {
+        sessionOut << e.what();
+      }
+      printed[i] = sessionOut.str();
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  std::string expected;
+  for (int k = 0; k < numDefinitions; ++k) {
+    expected += "Eval:\n" + std::to_string(k) + "\n";
+  }
+  for (const auto &sessionPrinted : printed) {
+    ASSERT_EQ(sessionPrinted, expected);
+  }
+}
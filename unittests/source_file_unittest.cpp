@@ -0,0 +1,62 @@
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "source_file.hpp"
+
+namespace {
+using names_t = std::vector<std::string>;
+
+// The names of the functions items define.
+names_t names(const std::vector<std::unique_ptr<ast::AstNode>> &items) {
+  names_t names;
+  for (const auto &item : items) {
+    names.push_back(std::get<ast::Function>(*item).proto->name);
+  }
+  return names;
+}
+} // namespace
+
+TEST(SourceFile, UpdatesReturnChangedItems) {
+  source::File file;
+  ASSERT_EQ(names(file.update("def f(x) x + 1\ndef g(x) f(x) * 2;\ng(3)\n")),
+            (names_t{"f", "g", "__anon_expr"}));
+  ASSERT_EQ(file.size(), 3);
+  ASSERT_EQ(names(file.update("def f(x) x + 1\ndef g(x)  f(x)*2;\ng(3)\n")),
+            names_t{});
+  ASSERT_EQ(names(file.update("def f(x) x + 2\ndef g(x)  f(x)*2;\ng(3)\n")),
+            names_t{"f"});
+  // Continues f rather than starting an item of its own.
+  ASSERT_EQ(
+      names(file.update("def f(x) x + 2\n- 1\ndef g(x)  f(x)*2;\ng(3)\n")),
+      names_t{"f"});
+  ASSERT_EQ(file.size(), 3);
+
+  ASSERT_ANY_THROW(file.update("def f(x x + 2\n- 1\ndef g(x)  f(x)*2;\n"));
+  ASSERT_EQ(names(file.update("def f(x) x + 2\n- 1\ndef g(x)  f(x)*2;\n"
+                              "def h(x) g(x)\ng(3)\n")),
+            names_t{"h"});
+  ASSERT_EQ(file.size(), 4);
+}
+
+TEST(SourceFile, RejectedItemsAreReturnedAgain) {
+  source::File file;
+  ASSERT_EQ(names(file.update("def f(x) x + 1\ndef g(x) f(x) * 2\n"
+                              "def h(x) x\n")),
+            (names_t{"f", "g", "h"}));
+  // g failed to compile, so h was never run either.
+  file.reject(1);
+  ASSERT_EQ(names(file.update("def f(x) x + 2\ndef g(x) f(x) * 2\n"
+                              "def h(x) x\n")),
+            (names_t{"f", "g", "h"}));
+  ASSERT_EQ(names(file.update("def f(x) x + 3\ndef g(x) f(x) * 2\n"
+                              "def h(x) x\n")),
+            names_t{"f"});
+  // Saving again unchanged retries what was rejected.
+  file.reject(0);
+  ASSERT_EQ(names(file.update("def f(x) x + 3\ndef g(x) f(x) * 2\n"
+                              "def h(x) x\n")),
+            names_t{"f"});
+  ASSERT_EQ(file.size(), 3);
+}
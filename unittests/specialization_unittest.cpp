@@ -0,0 +1,67 @@
+#include <gtest/gtest.h>
+
+#include <sstream>
+
+#include "llvm/Support/TargetSelect.h"
+
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "session.hpp"
+
+namespace {
+// Prototypes the session holds, specializations included.
+size_t countSymbols(session::Session &session, std::ostringstream &out) {
+  out.str("");
+  session.runCommand(":mem json");
+  std::string text = out.str();
+  std::string field = "\"symbols\":{\"count\":";
+  return std::stoul(text.substr(text.find(field) + field.size()));
+}
+} // namespace
+
+TEST(Specialization, ConstantArgumentsAreFound) {
+  std::stringstream ss;
+  ss << "f(2, 3, y) + f(2, 3, 4)";
+  lexer::Lexer lexer(ss);
+  parser::Parser parser;
+  auto expr = parser.parseExpression(lexer);
+  const auto &sum = std::get<ast::expr::Binary>(*expr);
+  const auto &lhs = std::get<ast::expr::Call>(*sum.lhs);
+  const auto &rhs = std::get<ast::expr::Call>(*sum.rhs);
+
+  // Literals passed for buffers aren't constants.
+  ast::Prototype proto("f", {"a", "b", "c"}, false,
+                       {ast::Type::I64, ast::Type::F64Buffer, ast::Type::F64});
+  auto constants = ast::constantArguments(lhs, proto);
+  ASSERT_EQ(constants.size(), 3);
+  ASSERT_EQ(constants[0], 2);
+  ASSERT_FALSE(constants[1]);
+  ASSERT_FALSE(constants[2]);
+
+  auto key = ast::specializationKey("f", constants);
+  ASSERT_EQ(key, ast::specializationKey("f", constants));
+  ASSERT_NE(key,
+            ast::specializationKey("f", ast::constantArguments(rhs, proto)));
+  ASSERT_NE(key, ast::specializationKey("g", constants));
+}
+
+TEST(Specialization, ClonesStayWithinTheBudget) {
+  llvm::InitializeNativeTarget();
+  llvm::InitializeNativeTargetAsmPrinter();
+  llvm::InitializeNativeTargetAsmParser();
+  llvm::orc::KaleidoscopeJIT jit;
+  const char *source = "def p(x, n) for i = 0, i < n in x * i; "
+                       "def q(x) p(x, 3) + 1";
+
+  // The clone of p takes more than one instruction.
+  for (size_t budget : {1, 4096}) {
+    std::ostringstream out;
+    session::Options options;
+    options.specializationBudget = budget;
+    session::Session session(jit, options, out);
+    std::stringstream input(source);
+    lexer::Lexer lexer(input);
+    session.run(lexer);
+    ASSERT_EQ(countSymbols(session, out), budget == 1 ? 2u : 3u);
+  }
+}